@@ -11,6 +11,9 @@
  * フォントやグリフのフォールバック先を管理する
  */
 
+#define RUN_CACHE       (256)   /* フォントを覚えておくランの数 (2の累乗) */
+
+struct RunFonts *getRunFonts(XFont *, int, const FcChar32 *, int);
 XftFontSuite *getFontSuiteGlyphs(XFont *, char32_t);
 XftFontSuite *getFontSuiteFonts(XFont *, const char *);
 char *getFontName(const unsigned char *, char32_t, char *, int);
@@ -21,8 +24,13 @@ openFont(Display *disp, const char *pattern)
 	XFont *xfont = xmalloc(sizeof(XFont));
 	const char *opt_head;
 	XGlyphInfo ginfo;
+	FT_UInt glyphs[0x7f - 0x21];
+	XftFont *font;
+	int i, n, c;
 
 	*xfont = (XFont){ .disp = disp, .cw = 1, .ch = 1 };
+	xfont->runs = xmalloc(RUN_CACHE * sizeof(struct RunFonts));
+	memset(xfont->runs, 0, RUN_CACHE * sizeof(struct RunFonts));
 
 	/* patternを:の前と:以降に分けて持つ */
 	opt_head = strchr(pattern, ':');
@@ -45,6 +53,19 @@ openFont(Display *disp, const char *pattern)
 	xfont->cw = 0 < ginfo.width ? ginfo.width : xfont->ch / 2;
 	xfont->ascent = (*xfont->fonts[0])[FONT_NONE]->ascent;
 
+	/* ASCIIのグリフは最初にまとめてGlyphSetに送っておく */
+	xfont->render = XftDefaultHasRender(disp);
+	if (xfont->render) {
+		for (i = 0; i < 4; i++) {
+			if (!(font = (*xfont->fonts[0])[i]))
+				continue;
+			for (n = 0, c = 0x21; c < 0x7f; c++)
+				if ((glyphs[n] = XftCharIndex(disp, font, c)))
+					n++;
+			XftFontLoadGlyphs(disp, font, FcTrue, glyphs, n);
+		}
+	}
+
 	return xfont;
 }
 
@@ -60,6 +81,12 @@ closeFont(XFont *xfont)
 		free(xfont->fonts[i]);
 	}
 
+	for (i = 0; i < RUN_CACHE; i++) {
+		free(xfont->runs[i].str);
+		free(xfont->runs[i].font);
+	}
+	free(xfont->runs);
+
 	free(xfont->family);
 	free(xfont->option);
 	free(xfont->glyphs);
@@ -69,21 +96,117 @@ closeFont(XFont *xfont)
 }
 
 void
-drawXFontString(XftDraw *draw, XftColor *color, XFont *xfont, int attr, int x, int y, int w, const FcChar32 *str, int num)
+drawXFontString(XftDraw *draw, XftColor *color, XFont *xfont, int attr, int x, int y, int left, int w, const FcChar32 *str, int num)
 {
-	XRectangle rect = { 0, -xfont->ascent, w, xfont->ch};
+	XRectangle rect = { -left, -xfont->ascent, left + w, xfont->ch};
+	XftCharFontSpec specs[MAX(num, 1)];
+	XftFont **font;
+	int i, n = 0;
+
+	XftDrawSetClipRectangles(draw, x, y, &rect, 1);
+
+	/* ラン全体を位置付きの文字にしてから1回で書く */
+	font = getRunFonts(xfont, attr, str, num)->font;
+	for (i = 0; i < num; x += xfont->cw * wcwidth(str[i]), i++)
+		if (str[i] != L' ' && font[i])
+			specs[n++] = (XftCharFontSpec){ font[i], str[i], x, y };
+
+	if (0 < n)
+		XftDrawCharFontSpec(draw, color, specs, n);
+}
+
+/*
+ * 文字列を位置付きのグリフに変換してspecsに入れる (空白は飛ばす)
+ *
+ * 色ごとにまとめてXftDrawGlyphFontSpecに渡すと、フォントが混ざっていても
+ * 1つのXRenderCompositeText32で書ける。specsにはnum個分の場所が要る。
+ */
+int
+getXFontGlyphs(XFont *xfont, int attr, int x, int y, const FcChar32 *str, int num, XftGlyphFontSpec *specs)
+{
+	XftFont **font;
+	int i, n = 0;
+
+	font = getRunFonts(xfont, attr, str, num)->font;
+	for (i = 0; i < num; x += xfont->cw * wcwidth(str[i]), i++)
+		if (str[i] != L' ' && font[i])
+			specs[n++] = (XftGlyphFontSpec){ font[i],
+				XftCharIndex(xfont->disp, font[i], str[i]), x, y };
+
+	return n;
+}
+
+/*
+ * 文字列を書いたときに、グリフのインクが送り幅の左端と右端からはみ出す幅を
+ * leftとrightに入れる
+ *
+ * 斜体などではみ出す分はフォントのグリフの大きさから求め、ランごとに覚えておく。
+ */
+void
+getXFontOverhang(XFont *xfont, int attr, const FcChar32 *str, int num, int *left, int *right)
+{
+	struct RunFonts *run = getRunFonts(xfont, attr, str, num);
+	XGlyphInfo info;
+	FT_UInt glyph;
+	int i, x, l = 0, r = 0;
+
+	if (run->left < 0) {
+		for (i = 0, x = 0; i < num; x += xfont->cw * wcwidth(str[i]), i++) {
+			if (str[i] == L' ' || !run->font[i])
+				continue;
+			glyph = XftCharIndex(xfont->disp, run->font[i], str[i]);
+			XftGlyphExtents(xfont->disp, run->font[i], &glyph, 1, &info);
+			l = MAX(l, info.x - x);
+			r = MAX(r, x - info.x + info.width);
+		}
+		run->left  = l;
+		run->right = MAX(r - x, 0);
+	}
+
+	*left  = run->left;
+	*right = run->right;
+}
+
+/*
+ * ランの各文字を書くフォントを返す
+ *
+ * 同じランは何度も書かれるので、文字と属性のハッシュで引けるように
+ * 覚えておき、1文字ずつのフォールバックの検索を省く。
+ */
+struct RunFonts *
+getRunFonts(XFont *xfont, int attr, const FcChar32 *str, int num)
+{
+	struct RunFonts *run;
 	XftFontSuite *font;
+	unsigned int hash = 2166136261u;
 	int i;
 
-	XftDrawSetClipRectangles(draw, x, y, &rect, 1);
 	attr = BETWEEN(attr, 0, 4) ? attr : 0;
+	for (i = 0; i < num; i++)
+		hash = (hash ^ str[i]) * 16777619u;
+	hash = (hash ^ attr) * 16777619u;
+
+	/* 覚えていればそれを返す */
+	run = &xfont->runs[hash & (RUN_CACHE - 1)];
+	if (run->str && run->hash == hash && run->attr == attr && run->len == num &&
+			memcmp(run->str, str, num * sizeof(char32_t)) == 0)
+		return run;
+
+	/* 1文字ずつフォントを探して覚える */
+	run->hash = hash;
+	run->attr = attr;
+	run->len = num;
+	run->left = run->right = -1;
+	run->str  = xrealloc(run->str,  MAX(num, 1) * sizeof(char32_t));
+	run->font = xrealloc(run->font, MAX(num, 1) * sizeof(XftFont *));
+	memcpy(run->str, str, num * sizeof(char32_t));
 	for (i = 0; i < num; i++) {
 		font = XftCharIndex(xfont->disp, (*xfont->fonts[0])[attr], str[i]) ?
 			xfont->fonts[0] : getFontSuiteGlyphs(xfont, str[i]);
-		if ((*font)[attr])
-			XftDrawString32(draw, color, (*font)[attr], x, y, &str[i], 1);
-		x += xfont->cw * wcwidth(str[i]);
+		run->font[i] = (*font)[attr];
 	}
+
+	return run;
 }
 
 XftFontSuite *
@@ -15,14 +15,24 @@ typedef struct XFont {
 	unsigned char *family, *option;
 	int cw, ch;
 	int ascent;
+	int render;             /* XRenderで文字をまとめて書けるか */
 	struct FallbackGlyph {
 		char32_t codepoint;
 		XftFontSuite *font;
 	} *glyphs;
 	XftFontSuite **fonts;
 	int glyphs_len, fonts_len;
+	struct RunFonts {
+		unsigned int hash;      /* 文字と属性のハッシュ */
+		int attr, len;
+		char32_t *str;          /* ランの文字 */
+		XftFont **font;         /* 各文字を書くフォント */
+		int left, right;        /* 左右にはみ出す幅 (-1は未計算) */
+	} *runs;
 } XFont;
 
 XFont *openFont(Display *, const char *);
 void closeFont(XFont *);
-void drawXFontString(XftDraw *, XftColor *, XFont *, int, int, int, int, const FcChar32 *, int);
+void drawXFontString(XftDraw *, XftColor *, XFont *, int, int, int, int, int, const FcChar32 *, int);
+int getXFontGlyphs(XFont *, int, int, int, const FcChar32 *, int, XftGlyphFontSpec *);
+void getXFontOverhang(XFont *, int, const FcChar32 *, int, int *, int *);
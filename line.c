@@ -1,3 +1,5 @@
+#include <limits.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -10,18 +12,106 @@
  * バッファ1行を管理する
  */
 
+#define POOL_CLASSES    (48)    /* サイズクラスの数 */
+#define SLAB_LINES      (64)    /* 一度に確保するLineの数 */
+#define CLASS_LEN(k)    ((size_t)((k) % 2 ? 48 : 32) << (k) / 2)
+#define CELL_SIZE       (sizeof(char32_t) + sizeof(int) + sizeof(Color) * 2)
+
 Color deffg = 256, defbg = 257;
 const Color PALETTE_SIZE = 258;
+uint64_t lastver = 0;
 
+/*
+ * LinePool
+ *
+ * Lineの配列は4つをまとめて1つのブロックに置く。
+ * ブロックは32, 48, 64, 96, ...の長さのサイズクラスに分けて使い回し、
+ * Lineの構造体自体はSLAB_LINES個ずつまとめて確保して使い回す。
+ * 構造体は配列と別に置くので、行が伸びてもLineのアドレスは変わらない。
+ */
+struct LinePool {
+	void *blocks[POOL_CLASSES];     /* サイズクラスごとの空きブロック */
+	Line *lines;                    /* 空きLine */
+	Line **slabs;                   /* まとめて確保したLine */
+	int slabs_len;
+	Line **table;                   /* 共有している行のハッシュ表 */
+	unsigned int table_size;        /* ハッシュ表の大きさ (2の累乗) */
+	unsigned int table_cnt;         /* 共有している行の数 */
+};
+
+static int getClass(size_t);
 static void reallocLine(Line *, size_t);
+static void freeBlock(LinePool *, void *, size_t);
+static unsigned int hashLine(const Line *);
+static bool lineeq(const Line *, const Line *);
+static void unlinkLine(Line *);
 static size_t u8decode(char32_t *, const unsigned char *, size_t);
 
+LinePool *
+createLinePool(void)
+{
+	LinePool *pool = xmalloc(sizeof(LinePool));
+
+	*pool = (LinePool){};
+
+	return pool;
+}
+
+void
+destroyLinePool(LinePool *pool)
+{
+	void *block, *next;
+	int i;
+
+	if (pool == NULL)
+		return;
+
+	for (i = 0; i < POOL_CLASSES; i++) {
+		for (block = pool->blocks[i]; block; block = next) {
+			next = *(void **)block;
+			free(block);
+		}
+	}
+	for (i = 0; i < pool->slabs_len; i++)
+		free(pool->slabs[i]);
+	free(pool->slabs);
+	free(pool->table);
+	free(pool);
+}
+
+int
+getClass(size_t len)
+{
+	int k;
+
+	for (k = 0; k < POOL_CLASSES - 1 && CLASS_LEN(k) < len; k++);
+
+	return k;
+}
+
 Line *
-allocLine(void)
+allocLine(LinePool *pool)
 {
-	Line *line = xmalloc(sizeof(Line));
+	Line *line, *slab;
+	int i;
 
-	*line = (Line){};
+	if (pool == NULL) {
+		line = xmalloc(sizeof(Line));
+	} else {
+		/* 空きがなければまとめて確保する */
+		if (pool->lines == NULL) {
+			slab = xmalloc(SLAB_LINES * sizeof(Line));
+			for (i = 0; i < SLAB_LINES; i++)
+				slab[i].next = i + 1 < SLAB_LINES ? &slab[i + 1] : NULL;
+			pool->lines = slab;
+			PUSH_BACK(pool->slabs, pool->slabs_len, slab);
+		}
+		line = pool->lines;
+		pool->lines = line->next;
+	}
+
+	*line = (Line){ .pool = pool, .fill = defbg };
+	NEW_VER(line);
 
 	reallocLine(line, 80);
 
@@ -36,11 +126,53 @@ allocLine(void)
 void
 reallocLine(Line *line, size_t len)
 {
-	line->len  = len;
-	line->str  = xrealloc(line->str,  len * sizeof(char32_t));
-	line->attr = xrealloc(line->attr, len * sizeof(int));
-	line->fg   = xrealloc(line->fg,   len * sizeof(Color));
-	line->bg   = xrealloc(line->bg,   len * sizeof(Color));
+	const int k = getClass(len);
+	const size_t oldlen = line->len;
+	char32_t *old = line->str;
+	char *block;
+
+	len = MAX(CLASS_LEN(k), len);
+
+	/* サイズクラスの空きブロックを使うか、なければ確保する */
+	if (line->pool && line->pool->blocks[k]) {
+		block = line->pool->blocks[k];
+		line->pool->blocks[k] = *(void **)block;
+	} else {
+		block = xmalloc(len * CELL_SIZE);
+	}
+
+	/* 4つの配列を1つのブロックに並べて中身を移す */
+#define MOVE(A, B) do {\
+	void *src = line->A;\
+	line->A = (void *)(B);\
+	if (src)\
+		memcpy(line->A, src, MIN(oldlen, len) * sizeof(line->A[0]));\
+} while (0)
+	MOVE(str,  block);
+	MOVE(attr, line->str  + len);
+	MOVE(fg,   line->attr + len);
+	MOVE(bg,   line->fg   + len);
+#undef MOVE
+	line->len = len;
+
+	freeBlock(line->pool, old, oldlen);
+}
+
+void
+freeBlock(LinePool *pool, void *block, size_t len)
+{
+	const int k = getClass(len);
+
+	if (block == NULL)
+		return;
+
+	if (pool == NULL || CLASS_LEN(k) != len) {
+		free(block);
+		return;
+	}
+
+	*(void **)block = pool->blocks[k];
+	pool->blocks[k] = block;
 }
 
 void
@@ -49,11 +181,152 @@ freeLine(Line *line)
 	if (line == NULL)
 		return;
 
-	free(line->str);
-	free(line->attr);
-	free(line->fg);
-	free(line->bg);
-	free(line);
+	/* 共有している行は最後の1つになったら解放する */
+	if (1 < line->ref) {
+		line->ref--;
+		return;
+	}
+	unlinkLine(line);
+
+	freeBlock(line->pool, line->str, line->len);
+
+	if (line->pool == NULL) {
+		free(line);
+		return;
+	}
+
+	line->next = line->pool->lines;
+	line->pool->lines = line;
+}
+
+/*
+ * 画面外に出た行は書き換えられないので、同じ内容の行を1つにまとめて
+ * 参照カウントで共有する。書き換えるときはunshareLineで取り出す。
+ */
+Line *
+shareLine(Line *line)
+{
+	LinePool *pool = line->pool;
+	const size_t len = u32slen(line->str) + 1;
+	Line **table, *l, *next;
+	unsigned int size, i;
+
+	if (pool == NULL || 0 < line->ref)
+		return line;
+
+	/* 同じ内容の行があればそれを使う */
+	line->hash = hashLine(line);
+	if (pool->table)
+		for (l = pool->table[line->hash & (pool->table_size - 1)]; l; l = l->next)
+			if (l->hash == line->hash && lineeq(l, line)) {
+				l->ref++;
+				freeLine(line);
+				return l;
+			}
+
+	/* 埋まってきたらハッシュ表を広げる */
+	if (pool->table_size <= pool->table_cnt) {
+		size = MAX(pool->table_size * 2, 1024);
+		table = xmalloc(size * sizeof(Line *));
+		memset(table, 0, size * sizeof(Line *));
+		for (i = 0; i < pool->table_size; i++) {
+			for (l = pool->table[i]; l; l = next) {
+				next = l->next;
+				l->next = table[l->hash & (size - 1)];
+				table[l->hash & (size - 1)] = l;
+			}
+		}
+		free(pool->table);
+		pool->table = table;
+		pool->table_size = size;
+	}
+
+	/* 書き換えないのでちょうどいい大きさに詰めてから登録する */
+	if (CLASS_LEN(getClass(len)) < line->len)
+		reallocLine(line, len);
+	i = line->hash & (pool->table_size - 1);
+	line->next = pool->table[i];
+	pool->table[i] = line;
+	line->ref = 1;
+	pool->table_cnt++;
+
+	return line;
+}
+
+Line *
+unshareLine(Line *line)
+{
+	Line *copy;
+
+	/* 共有していない */
+	if (line->ref == 0)
+		return line;
+
+	/* 他に使われていなければそのまま取り出す */
+	if (line->ref == 1) {
+		unlinkLine(line);
+		return line;
+	}
+
+	/* 使われていればコピーする */
+	line->ref--;
+	copy = allocLine(line->pool);
+	linecpy(copy, line);
+	copy->ver = line->ver;
+
+	return copy;
+}
+
+void
+unlinkLine(Line *line)
+{
+	LinePool *pool = line->pool;
+	Line **pl;
+
+	if (line->ref == 0 || pool == NULL)
+		return;
+
+	for (pl = &pool->table[line->hash & (pool->table_size - 1)]; *pl; pl = &(*pl)->next) {
+		if (*pl == line) {
+			*pl = line->next;
+			break;
+		}
+	}
+	line->ref = 0;
+	pool->table_cnt--;
+}
+
+unsigned int
+hashLine(const Line *line)
+{
+	const size_t len = u32slen(line->str);
+	unsigned int hash = 2166136261u;
+	size_t i;
+
+	/* FNV-1a */
+	hash = (hash ^ line->fill) * 16777619u;
+	hash = (hash ^ line->wrap) * 16777619u;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ line->str [i]) * 16777619u;
+		hash = (hash ^ line->attr[i]) * 16777619u;
+		hash = (hash ^ line->fg  [i]) * 16777619u;
+		hash = (hash ^ line->bg  [i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+bool
+lineeq(const Line *line1, const Line *line2)
+{
+	const size_t len = u32slen(line1->str);
+
+	return len == u32slen(line2->str) && line1->fill == line2->fill &&
+		line1->wrap == line2->wrap &&
+		!memcmp(line1->str,  line2->str,  len * sizeof(char32_t)) &&
+		!memcmp(line1->attr, line2->attr, len * sizeof(int)) &&
+		!memcmp(line1->fg,   line2->fg,   len * sizeof(Color)) &&
+		!memcmp(line1->bg,   line2->bg,   len * sizeof(Color));
 }
 
 void
@@ -68,23 +341,61 @@ linecpy(Line *dst, const Line *src)
 	memcpy(dst->attr, src->attr, len * sizeof(int));
 	memcpy(dst->fg,   src->fg,   len * sizeof(Color));
 	memcpy(dst->bg,   src->bg,   len * sizeof(Color));
+	dst->fill = src->fill;
+	dst->wrap = src->wrap;
+	dst->ver = src->ver;
+	dst->basever = src->basever;
+	dst->dirty_head = src->dirty_head;
+	dst->dirty_tail = src->dirty_tail;
 }
 
-int
-linecmp(Line *line1, Line *line2, int pos, int len)
+/*
+ * 行の内容を変えたらバージョンを更新して、書き換えた範囲を広げる
+ *
+ * 範囲は文字のインデックスで、幅の変わる変更では行末(INT_MAX)まで含める。
+ * basever時点の内容とはこの範囲の外の文字が同じ桁に並んでいることになる。
+ * 折り返しや行末以降の背景色だけの変更は空の範囲を渡す。
+ */
+void
+touchLine(Line *line, int head, int tail)
+{
+	if (head < tail) {
+		if (line->dirty_tail <= line->dirty_head) {
+			line->dirty_head = head;
+			line->dirty_tail = tail;
+		} else {
+			line->dirty_head = MIN(line->dirty_head, head);
+			line->dirty_tail = MAX(line->dirty_tail, tail);
+		}
+	}
+	NEW_VER(line);
+}
+
+/* 今の内容を書き換えた範囲の起点にする */
+void
+cleanLine(Line *line)
+{
+	line->basever = line->ver;
+	line->dirty_head = line->dirty_tail = 0;
+}
+
+/* srcの内容をdstの末尾に繋げる */
+void
+appendLine(Line *dst, const Line *src)
 {
-	int index1, col1, width1;
-	int index2, col2, width2;
-
-	getCharCnt(line1->str, pos, &index1, &col1, &width1);
-	getCharCnt(line2->str, pos, &index2, &col2, &width2);
-
-#define CMP(A,T) !memcmp(&line1->A[index1], &line2->A[index2], len * sizeof(T))
-	if (col1 == col2 && index2 + len <= u32slen(line2->str) &&
-	    CMP(str, char32_t) && CMP(attr, int) && CMP(fg, Color) && CMP(bg, Color))
-			return 1;
-	return 0;
-#undef CMP
+	const size_t head = u32slen(dst->str);
+	const size_t len = u32slen(src->str) + 1;
+
+	if (dst->len < head + len)
+		reallocLine(dst, head + len);
+
+	memcpy(&dst->str [head], src->str,  len * sizeof(char32_t));
+	memcpy(&dst->attr[head], src->attr, len * sizeof(int));
+	memcpy(&dst->fg  [head], src->fg,   len * sizeof(Color));
+	memcpy(&dst->bg  [head], src->bg,   len * sizeof(Color));
+	dst->fill = src->fill;
+	dst->wrap = src->wrap;
+	touchLine(dst, head, INT_MAX);
 }
 
 void
@@ -116,7 +427,7 @@ insertU32s(Line *line, int head, const char32_t *str, int attr, Color fg, Color
 		line->bg[head + i] = bg;
 	}
 
-	line->ver++;
+	touchLine(line, src, INT_MAX);
 }
 
 void
@@ -134,7 +445,7 @@ deleteChars(Line *line, int head, int len)
 	memmove(&line->fg  [head], &line->fg  [tail], movelen * sizeof(Color));
 	memmove(&line->bg  [head], &line->bg  [tail], movelen * sizeof(Color));
 
-	line->ver++;
+	touchLine(line, head, INT_MAX);
 }
 
 int
@@ -142,6 +453,7 @@ eraseInLine(Line *line, int col, int width)
 {
 	const int attr = 0;
 	const int linelen = u32slen(line->str);
+	const int linewidth = u32snwidth(line->str, linelen);
 	int head, tail;
 	int lpad, rpad;
 	int index, c, w;
@@ -151,7 +463,7 @@ eraseInLine(Line *line, int col, int width)
 
 	getCharCnt(line->str, col, &index, &c, &w);
 	head = MIN(index, linelen);
-	lpad = col - MIN(c, u32snwidth(line->str, linelen));
+	lpad = col - MIN(c, linewidth);
 
 	getCharCnt(line->str, col + width - 1, &index, &c, &w);
 	tail = MIN(index, linelen) + 1;
@@ -163,10 +475,12 @@ eraseInLine(Line *line, int col, int width)
 
 	deleteChars(line, head, tail - head);
 
+	/* 行末より後ろは行末以降の背景色で埋める */
 	if (0 < rpad + lpad) {
 		char32_t str[rpad + lpad];
 		INIT(str, L' ');
-		insertU32s(line, head, str, attr, deffg, defbg, rpad + lpad);
+		insertU32s(line, head, str, attr, deffg,
+				linewidth < col ? line->fill : defbg, rpad + lpad);
 	}
 
 	return head + lpad;
@@ -195,6 +509,7 @@ putU32s(Line *line, int col, const char32_t *str, int attr, Color fg, Color bg,
 			line->fg  [i] = fg;
 			line->bg  [i] = bg;
 		}
+		touchLine(line, head, head + len);
 	}
 
 	return width;
@@ -203,12 +518,47 @@ putU32s(Line *line, int col, const char32_t *str, int attr, Color fg, Color bg,
 void
 putSPCs(Line *line, int col, Color bg, size_t n)
 {
-	char32_t str[n] = {};
+	char32_t str[n];
+
+	/* 行末より後ろを同じ色で消す場合は何もしなくていい */
+	if (bg == line->fill && u32swidth(line->str) <= col)
+		return;
 
 	INIT(str, L' ');
 	putU32s(line, col, str, 0, deffg, bg, n);
 }
 
+/*
+ * col以降を消去して背景色bgで塗りつぶす
+ *
+ * 空白を並べる代わりに行を切り詰めて、行末以降の背景色を変える。
+ * 行末が消えるので次の行への折り返しも解除する。
+ */
+void
+clearToEnd(Line *line, int col, Color bg)
+{
+	const int width = u32swidth(line->str);
+
+	if (col < 0)
+		return;
+
+	if (col < width) {
+		/* colより後ろを切り詰める */
+		eraseInLine(line, col, width - col);
+	} else if (width < col && line->fill != bg) {
+		/* 行末からcolまでは元の背景色の空白にする */
+		char32_t str[col - width];
+		INIT(str, L' ');
+		insertU32s(line, u32slen(line->str), str, NONE, deffg, line->fill, col - width);
+	}
+
+	if (line->fill != bg || line->wrap) {
+		line->fill = bg;
+		line->wrap = 0;
+		touchLine(line, 0, 0);
+	}
+}
+
 int
 findNextSGR(const Line *line, int index)
 {
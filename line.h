@@ -6,8 +6,10 @@ typedef uint_least32_t Color;
 
 extern Color deffg, defbg;
 extern const Color PALETTE_SIZE;
+extern uint64_t lastver;
 
-#define PUT_NUL(l, x)   putU32s((l), (x), (char32_t *)L"\0", 0, deffg, defbg, 1)
+#define PUT_NUL(l, x)   clearToEnd((l), (x), defbg)
+#define NEW_VER(l)      ((l)->ver = ++lastver)
 #define u32swidth(s)    u32snwidth(s, u32slen(s))
 #define u32slen(s)      wcslen((const wchar_t *)s)
 #define u32snwidth(s, l)wcswidth((const wchar_t *)s, l)
@@ -26,23 +28,41 @@ enum sgr_attribute {
 	DULINE  = 1 << 9    /* 二重下線 */
 };
 
+typedef struct LinePool LinePool;
+
 typedef struct Line {
 	char32_t *str;
 	int *attr;
 	Color *fg, *bg;
 	size_t len;
-	int ver;
+	uint64_t ver;           /* 内容を変えるたびに全体で一意な値にする */
+	uint64_t basever;       /* dirty_head, dirty_tailの起点のバージョン */
+	int dirty_head;         /* basever以降に書き換えた文字の範囲 */
+	int dirty_tail;         /* (dirty_tail <= dirty_headなら変化なし) */
+	Color fill;             /* 行末以降の背景色 */
+	int wrap;               /* 次の行に折り返しているか */
+	LinePool *pool;         /* 確保元 (NULLならmalloc) */
+	struct Line *next;      /* 空きリストかハッシュ表の次の行 */
+	int ref;                /* 共有している数 (0なら共有していない) */
+	unsigned int hash;      /* 共有しているときの内容のハッシュ */
 } Line;
 
-Line *allocLine(void);
+LinePool *createLinePool(void);
+void destroyLinePool(LinePool *);
+Line *allocLine(LinePool *);
 void freeLine(Line *);
+Line *shareLine(Line *);
+Line *unshareLine(Line *);
 void linecpy(Line *, const Line *);
-int linecmp(Line *, Line *, int, int);
+void touchLine(Line *, int, int);
+void cleanLine(Line *);
+void appendLine(Line *, const Line *);
 void insertU32s(Line *, int, const char32_t *, int, Color, Color, int);
 void deleteChars(Line *, int, int);
 int eraseInLine(Line *, int, int);
 int putU32s(Line *, int, const char32_t *, int, Color, Color, size_t);
 void putSPCs(Line *, int, Color, size_t);
+void clearToEnd(Line *, int, Color);
 int findNextSGR(const Line *, int);
 
 const char *u8sToU32s(char32_t *,const char *, size_t);
@@ -1,3 +1,4 @@
+#include <sys/ioctl.h>
 #include <sys/select.h>
 #include <errno.h>
 #include <locale.h>
@@ -8,6 +9,9 @@
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/Xresource.h>
+#ifdef HAVE_XPRESENT
+#include <X11/extensions/Xpresent.h>
+#endif
 
 #include "pane.h"
 #include "util.h"
@@ -33,6 +37,15 @@ typedef struct Win {
 	char *primary, *clip;
 	IME ime;
 	Pane *pane, *dragging;
+#ifdef HAVE_XPRESENT
+	Pixmap back;            /* Presentで送るPixmap */
+	XserverRegion update;   /* Presentで書き換える範囲 */
+	Region expose;          /* Presentでまだ写していない隠れていた部分 */
+	uint32_t serial;        /* 最後に送ったフレームの番号 */
+	bool inflight;          /* 送ったフレームがまだ表示されていない */
+	bool held;              /* 送ったPixmapをまだサーバーが使っている */
+	nsec sent;              /* 最後にフレームを送った時刻 */
+#endif
 } Win;
 
 enum { CLIPBOARD, UTF8_STRING, WM_DELETE_WINDOW, ATOM_NUM };
@@ -43,20 +56,28 @@ static XFont *xfont;
 static XIM xim;
 static Win *win;
 static struct timespec now;
+static int refresh = 60;
+#ifdef HAVE_XPRESENT
+static int present_op;
+static const nsec present_timeout = 100 * 1000 * 1000;  /* 表示の通知を待つ最長の時間 */
+#endif
 
 static void init(int, char *[]);
 static void run(void);
 static void fin(void);
 
 /* Win */
-static Win *openWindow(int ,int, int, int, int, float, char *const []);
+static Win *openWindow(int ,int, int, int, int, bool, bool, bool, float, char *const []);
 static void closeWindow(Win *);
 static void setWindowName(Win *, const char *);
 static int handleXEvent(Win *);
 static int keyPressEvent(Win *, XEvent, int);
 static void sendSelection(Win *, XEvent);
 static void receiveSelection(Win *, Pane *, XEvent);
-static void redraw(Win *);
+static int redraw(Win *);
+#ifdef HAVE_XPRESENT
+static void presentWindow(Win *);
+#endif
 
 /* IME */
 static void ximOpen(Display *, XPointer, XPointer);
@@ -74,7 +95,11 @@ static const char help[] = "usage: chitan [-options] [[-e] command [args ...]]\n
 "        -f font                 font selection pattern (ex. monospace:size=12)\n"
 "        -g geometry             size (in chars) and position (ex. 80x24+0+0)\n"
 "        -h                      show this help\n"
-"        -l number               number of lines in buffer\n"
+"        -l number               number of lines kept in buffer\n"
+"        -m                      draw on the client and present with MIT-SHM\n"
+"        -p                      pace frames with the Present extension\n"
+"        -r rate                 refresh rate in Hz (ex. 60, 120, 144)\n"
+"        -s                      spill scrollback to a temporary file\n"
 "        -v                      show version\n"
 "        -e command [args ...]   command to execute (must be the last)\n";
 
@@ -96,6 +121,7 @@ init(int argc, char *argv[])
 	XrmValue val;
 	float alpha = 1.0;
 	int buflines = 1024;
+	bool spill = false, shm = false, present = false;
 	char pattern_str[256] = "monospace", *pattern = pattern_str;
 	char geometry_str[256] = "80x24+0+0", *geometry = geometry_str;
 	char **cmd = (char *[]){ NULL };
@@ -127,18 +153,26 @@ init(int argc, char *argv[])
 	if (XRES("chitan.font"))        strcpy(pattern_str, val.addr);
 	if (XRES("chitan.geometry"))    strcpy(geometry_str, val.addr);
 	if (XRES("chitan.lines"))       buflines = atof(val.addr);
+	if (XRES("chitan.spill"))       spill    = !strcmp(val.addr, "true");
+	if (XRES("chitan.present"))     present  = !strcmp(val.addr, "true");
+	if (XRES("chitan.refresh"))     refresh  = atoi(val.addr);
+	if (XRES("chitan.shm"))         shm      = !strcmp(val.addr, "true");
 #undef XRES
 	XrmDestroyDatabase(xdb);
 
 	/* コマンドライン引数 */
 	while (1) {
-		switch (getopt(argc, argv, "+a:f:g:l:hve:")) {
+		switch (getopt(argc, argv, "+a:f:g:l:mpr:shve:")) {
 		case '?': printf("%s", help);                   goto finish;
 		case 'a': alpha = CLIP(atof(optarg), 0, 1.0);   continue;
 		case 'f': pattern = optarg;                     continue;
 		case 'g': geometry = optarg;                    continue;
 		case 'h': printf("%s", help);                   goto finish;
 		case 'l': buflines = MAX(atoi(optarg), 1);      continue;
+		case 'm': shm = true;                           continue;
+		case 'p': present = true;                       continue;
+		case 'r': refresh = atoi(optarg);               continue;
+		case 's': spill = true;                         continue;
 		case 'v': printf("%s\n", version);              goto finish;
 		case 'e': cmd = argv + optind - 1;              break;
 		default : cmd = argv + optind;                  break;
@@ -163,6 +197,8 @@ finish:
 	if (xfont == NULL)
 		fatal("XftFontOpen failed.\n");
 
+	refresh = CLIP(refresh, 1, 1000);
+
 	/* ウィンドウの作成 */
 	x = y = col = row = 0;
 	XParseGeometry(geometry, &x, &y, &col, &row);
@@ -170,15 +206,18 @@ finish:
 	cmd[0] = cmd[0] ? cmd[0] : "/bin/sh";
 	w = col * xfont->cw + xfont->cw;
 	h = row * xfont->ch + xfont->cw;
-	win = openWindow(w, h, x, y, buflines, alpha, cmd);
+	win = openWindow(w, h, x, y, buflines, spill, shm, present, alpha, cmd);
 }
 
 void
 run(void)
 {
 	Pane *pane = win->pane;
-	struct timespec timeout = { 0, 0 }, lastdraw;
-	nsec rest;
+	struct timespec timeout = { 0, 0 }, lastdraw, start, drawn;
+	const nsec frame = GIGA / refresh;
+	const nsec flood = MAX(frame, 50 * 1000 * 1000);
+	nsec interval = frame, cost = 0, rest;
+	int backlog;
 	fd_set rfds;
 	const int xfd = XConnectionNumber(dinfo.disp);
 	const int tfd = pane->term->master;
@@ -216,11 +255,11 @@ run(void)
 			}
 		}
 
-		/* 再描画の頻度を制限 */
+		/* 前の描画から間隔が空くまで待つ */
 		if (FD_ISSET(xfd, &rfds) || FD_ISSET(tfd, &rfds)) {
-			rest = 50 * 1000 * 1000 - (tstons(now) - tstons(lastdraw));
+			rest = interval - (tstons(now) - tstons(lastdraw));
 			if (0 < rest) {
-				timeout = (struct timespec){ 0, MIN(rest, 1 * 1000 * 1000) };
+				timeout = nstots(rest);
 				continue;
 			}
 		}
@@ -232,12 +271,31 @@ run(void)
 			XSetICValues(win->ime.xic, XNPreeditAttributes, win->ime.spotlist, NULL);
 		}
 
-		/* 再描画 */
-		redraw(win);
-		lastdraw = now;
+		/* 再描画 (読み込みの時間は含めずに描画にかかった時間を測る) */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (redraw(win)) {
+			clock_gettime(CLOCK_MONOTONIC, &drawn);
+			cost += (tstons(drawn) - tstons(start) - cost) / 8;
+			lastdraw = now;
+
+			/*
+			 * 次の描画までの間隔
+			 * 読み切れていない出力があれば間隔を広げて読むほうを優先し、
+			 * なければ描画が時間の1/4以下に収まる範囲でリフレッシュレートに合わせる
+			 */
+			if (ioctl(tfd, FIONREAD, &backlog) == 0 && 0 < backlog)
+				interval = MIN(interval * 2, flood);
+			else
+				interval = CLIP(cost * 4, frame, flood);
+		}
 
 		/* 次の待機時間を取得 */
-		timeout = nstots(getNextTime(pane, tstons(now)));
+		rest = getNextTime(pane, tstons(now));
+#ifdef HAVE_XPRESENT
+		if (win->inflight || win->held)
+			rest = MIN(MAX(win->sent + present_timeout - tstons(now), 0), rest);
+#endif
+		timeout = nstots(rest);
 	}
 }
 
@@ -253,9 +311,13 @@ fin(void)
 }
 
 Win *
-openWindow(int w, int h, int x, int y, int buflines, float alpha, char *const cmd[])
+openWindow(int w, int h, int x, int y, int buflines, bool spill, bool shm, bool present,
+		float alpha, char *const cmd[])
 {
 	Win *win = xmalloc(sizeof(Win));
+#ifdef HAVE_XPRESENT
+	int event, error;
+#endif
 
 	*win = (Win){ .width = w, .height = h};
 
@@ -279,12 +341,27 @@ openWindow(int w, int h, int x, int y, int buflines, float alpha, char *const cm
 	win->gc = XCreateGC(dinfo.disp, win->window, 0, NULL);
 	win->draw = XftDrawCreate(dinfo.disp, win->window, dinfo.visual, dinfo.cmap);
 
+	/* Presentで表示が終わったときイベントを受け取る */
+#ifdef HAVE_XPRESENT
+	if (present && !XPresentQueryExtension(dinfo.disp, &present_op, &event, &error))
+		fprintf(stderr, "Present extension is not available.\n");
+	if (present && present_op) {
+		XPresentSelectInput(dinfo.disp, win->window,
+				PresentCompleteNotifyMask | PresentIdleNotifyMask);
+		win->update = XFixesCreateRegion(dinfo.disp, NULL, 0);
+		win->expose = XCreateRegion();
+	}
+#else
+	if (present)
+		fprintf(stderr, "Present extension is not available.\n");
+#endif
+
 	/* IME */
 	xicOpen(win);
 	win->ime.spotlist = XVaCreateNestedList(0,
 			XNSpotLocation, &win->ime.spot,
 			NULL);
-	win->ime.peline = allocLine();
+	win->ime.peline = allocLine(NULL);
 
 	/* ウィンドウが閉じられたときイベントを受け取る */
 	XSetWMProtocols(dinfo.disp, win->window, &atoms[WM_DELETE_WINDOW], 1);
@@ -294,7 +371,7 @@ openWindow(int w, int h, int x, int y, int buflines, float alpha, char *const cm
 	XFlush(dinfo.disp);
 
 	/* Pane作成 */
-	win->pane = createPane(&dinfo, xfont, w, h, alpha, buflines, cmd);
+	win->pane = createPane(&dinfo, xfont, w, h, alpha, buflines, spill, shm, cmd);
 
 	return win;
 }
@@ -309,6 +386,14 @@ closeWindow(Win *win)
 	if (win->ime.xic)
 		XDestroyIC(win->ime.xic);
 	XftDrawDestroy(win->draw);
+#ifdef HAVE_XPRESENT
+	if (win->back)
+		XFreePixmap(dinfo.disp, win->back);
+	if (win->update)
+		XFixesDestroyRegion(dinfo.disp, win->update);
+	if (win->expose)
+		XDestroyRegion(win->expose);
+#endif
 	XFreeGC(dinfo.disp, win->gc);
 	XFree(win->hint);
 	XDestroyWindow(dinfo.disp, win->window);
@@ -336,7 +421,14 @@ handleXEvent(Win *win)
 	Pane *pane = win->pane;
 	XEvent event;
 	const XConfigureEvent *ce = (XConfigureEvent *)&event;
+	const XExposeEvent *ee = (XExposeEvent *)&event;
 	const XClientMessageEvent *cme = (XClientMessageEvent *)&event;
+#ifdef HAVE_XPRESENT
+	const XPresentCompleteNotifyEvent *pce;
+	const XPresentIdleNotifyEvent *pie;
+#endif
+	XRectangle rect;
+	Region region;
 	int mx, my, ms, mb;
 
 	while (0 < XPending(dinfo.disp)) {
@@ -400,15 +492,32 @@ handleXEvent(Win *win)
 			}
 			break;
 
-		case Expose:            /* 再描画 */
-			pane->redraw_flag = true;
+		case Expose:            /* 隠れていた部分をPixmapから写す */
+			rect = (XRectangle){ ee->x, ee->y, ee->width, ee->height };
+#ifdef HAVE_XPRESENT
+			if (present_op) {
+				/* Presentを使うときは次のフレームで一緒に送る */
+				XUnionRectWithRegion(&rect, win->expose, win->expose);
+				break;
+			}
+#endif
+			region = XCreateRegion();
+			XUnionRectWithRegion(&rect, region, region);
+			presentPane(pane, win->window, win->gc, region);
+			XDestroyRegion(region);
 			break;
 
 		case ConfigureNotify:   /* ウィンドウサイズ変更 */
 			if (win->width != ce->width || win->height != ce->height) {
 				win->width  = ce->width;
 				win->height = ce->height;
-				setPaneSize(pane, ce->width, ce->height);
+				setPaneSize(pane, ce->width, ce->height, tstons(now));
+#ifdef HAVE_XPRESENT
+				if (win->back)
+					XFreePixmap(dinfo.disp, win->back);
+				win->back = None;
+				win->held = false;
+#endif
 			}
 			break;
 
@@ -430,6 +539,27 @@ handleXEvent(Win *win)
 		case SelectionNotify:   /* 貼り付ける文字列が届いた */
 			receiveSelection(win, pane, event);
 			break;
+
+#ifdef HAVE_XPRESENT
+		case GenericEvent:      /* Presentで送ったフレームが表示された */
+			if (!present_op || event.xcookie.extension != present_op ||
+			    !XGetEventData(dinfo.disp, &event.xcookie))
+				break;
+			pce = event.xcookie.data;
+			pie = event.xcookie.data;
+			if (event.xcookie.evtype == PresentCompleteNotify &&
+			    pce->serial_number == win->serial)
+				win->inflight = false;
+			if (event.xcookie.evtype == PresentIdleNotify &&
+			    pie->serial_number == win->serial)
+				win->held = false;
+			XFreeEventData(dinfo.disp, &event.xcookie);
+			break;
+#endif
+
+		default:                /* MIT-SHMで送った画像が読まれた */
+			shmCompletionEvent(pane, &event);
+			break;
 		}
 	}
 
@@ -581,16 +711,84 @@ receiveSelection(Win *win, Pane *pane, XEvent event)
 	XFree(props);
 }
 
-void
+int
 redraw(Win *win)
 {
+	bool drawn;
+
+#ifdef HAVE_XPRESENT
+	/* 送ったフレームが表示されて、Pixmapが手放されるまでは描かない */
+	if ((win->inflight || win->held) && tstons(now) - win->sent < present_timeout)
+		return 0;
+	win->inflight = false;
+
+	/* 待ちきれなければ手放されていないPixmapは捨てて、新しく作って描く */
+	if (win->held) {
+		XFreePixmap(dinfo.disp, win->back);
+		win->back = None;
+		win->held = false;
+	}
+#endif
+
 	setWindowName(win, win->pane->term->title);
-	if (drawPane(win->pane, tstons(now), win->ime.peline, win->ime.caret)) {
-		XCopyArea(dinfo.disp, win->pane->pixmap, win->window, win->gc,
-				0, 0, win->pane->width, win->pane->height, 0, 0);
+	drawn = drawPane(win->pane, tstons(now), win->ime.peline, win->ime.caret);
+
+	/* 書き換えた範囲だけウィンドウに写す */
+#ifdef HAVE_XPRESENT
+	if (present_op && drawn)
+		XUnionRegion(win->expose, win->pane->damage, win->expose);
+	if (present_op && !XEmptyRegion(win->expose)) {
+		presentWindow(win);
 		XFlush(dinfo.disp);
+		return 1;
+	}
+#endif
+	if (!drawn)
+		return 0;
+	presentPane(win->pane, win->window, win->gc, win->pane->damage);
+	XFlush(dinfo.disp);
+	return 1;
+}
+
+#ifdef HAVE_XPRESENT
+/*
+ * Presentでフレームを送る
+ * 裏のPixmapに書き換えた範囲 (隠れていた部分を含む) を写してから、その範囲だけを表示させる
+ */
+void
+presentWindow(Win *win)
+{
+	Pane *pane = win->pane;
+	XRectangle rects[2] = { { 0, 0, win->width, win->height } };
+	Region region;
+
+	/* 裏のPixmapを作ったときは全体を写す */
+	if (win->back == None) {
+		win->back = XCreatePixmap(dinfo.disp, win->window,
+				win->width, win->height, 32);
+		region = XCreateRegion();
+		XUnionRectWithRegion(&rects[0], region, region);
+		presentPane(pane, win->back, win->gc, region);
+		XDestroyRegion(region);
+	} else {
+		presentPane(pane, win->back, win->gc, win->expose);
+		XClipBox(win->expose, &rects[0]);
 	}
+	XDestroyRegion(win->expose);
+	win->expose = XCreateRegion();
+
+	/* カーソルとPreeditの範囲も書き換える */
+	rects[1] = (XRectangle){ pane->over_x, pane->over_y, pane->over_w, pane->over_h };
+	XFixesSetRegion(dinfo.disp, win->update, rects, 0 < pane->over_w ? 2 : 1);
+
+	XPresentPixmap(dinfo.disp, win->window, win->back, ++win->serial,
+			None, win->update, 0, 0, None, None, None,
+			PresentOptionCopy, 0, 0, 0, NULL, 0);
+	win->inflight = true;
+	win->held = true;
+	win->sent = tstons(now);
 }
+#endif
 
 void
 ximOpen(Display *disp, XPointer, XPointer)
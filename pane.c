@@ -1,7 +1,10 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <X11/Xresource.h>
 
 #include "pane.h"
+#include "raster.h"
 #include "util.h"
 
 /*
@@ -15,22 +18,115 @@
 		((int)(  RED(c1) * (a1) +   RED(c2) * (a2)) << 16) +\
 		((int)(GREEN(c1) * (a1) + GREEN(c2) * (a2)) <<  8) +\
 		((int)( BLUE(c1) * (a1) +  BLUE(c2) * (a2)) <<  0))
-#define BELLCOLOR(c)    (now < pane->bell_time ? BLEND_COLOR((c), 0.925, 0xffffffff, 0.075) : (c))
-#define SCROLLMAX(sb)   ((sb)->firstline - MAX((sb)->totallines - (sb)->maxlines, 0))
+#define SCROLLMAX(sb)   MIN((sb)->firstline - getOldestLine(sb), INT_MAX)
 #define NEW_LINE(p, n)  (pane->new_lines[n + 1])
 #define OLD_LINE(p, n)  (pane->old_lines[n + 1])
+#define ROW_RUNS(p, n)  (pane->runs[n + 1])
+#define PIXMAP_SLACK(n) ((n) + (n) / 4)
+#define PALETTE_WORDS   (5)     /* PALETTE_SIZEビットを入れるのに要る数 */
+#define ON_PIXMAP(p)    ((p)->raster ? (p)->canvas_raster == (p)->raster : (p)->canvas == (p)->pixmap)
+#define BATCH_PUSH(arr, len, size, new) do {\
+	if ((size) <= (len)) {\
+		(size) = MAX((size) * 2, 64);\
+		(arr) = xrealloc((arr), (size) * sizeof((arr)[0]));\
+	}\
+	(arr)[(len)++] = (new);\
+} while (0)
 const long long blink_duration = 800 * 1000 * 1000;
 const long long rapid_duration = 200 * 1000 * 1000;
 const long long caret_duration = 500 * 1000 * 1000;
+const long long resize_delay   = 100 * 1000 * 1000;
+
+/* 前回書いた行の中の、同じ属性が続く文字の並び */
+typedef struct Run {
+	unsigned int hash;      /* 文字と属性のハッシュ */
+	int row, col;           /* 画面上の位置 */
+	int index, len;         /* 行の中の位置と文字数 */
+	struct Run *next;       /* ハッシュ表の同じ枠の次 */
+} Run;
+
+/* 前回書いた行ごとのRunの並び (行のverが変わったら作り直す) */
+typedef struct RowRuns {
+	uint64_t ver;
+	Run *runs;
+	int len, size;
+	bool drawn;             /* 今回のフレームで書き換えたか (コピー元にできない) */
+	uint64_t colors_ver;
+	uint64_t colors[PALETTE_WORDS]; /* 使っているパレットの色 */
+} RowRuns;
+
+/*
+ * 前回書いた点滅する文字の並び
+ *
+ * Pixmapには表示した状態で書いてblinkに写しておき、点滅の切り替わりでは
+ * 行を取り直さずに、これだけをblinkからのコピーか背景色の塗りつぶしで書き直す。
+ */
+typedef struct Blink {
+	int x, y, w;            /* Pixmap上の範囲 */
+	Color bg;               /* 消えているときの色 */
+	int attr;               /* BLINKとRAPID */
+	bool shown;             /* Pixmapに表示した状態が書かれているか */
+} Blink;
+
+/*
+ * 1フレーム分まとめて書く背景・文字・線
+ *
+ * drawLineや行末の塗りつぶしで溜めておき、flushBatchで色ごとにまとめて送る。
+ * どれも先頭のメンバーが色なので同じ比較関数で並べ替えられる。
+ * 文字だけは行ごとに切るので、先に行で並べ替える。
+ */
+typedef struct Batch {
+	struct BatchFill { Color color; XRectangle rect; } *fills;
+	struct BatchText {
+		Color color;
+		int attr, x, y;
+		int left;               /* 左にはみ出して書く幅 */
+		int w;                  /* 右のはみ出しも含めて書く幅 */
+		const char32_t *str;
+		int len;
+	} *texts;
+	struct BatchLine { Color color; XSegment seg; } *lines;
+	int fills_len, fills_size;
+	int texts_len, texts_size;
+	int lines_len, lines_size;
+	XRectangle *rects;              /* 送るときの作業用 */
+	XSegment *segs;
+	XftGlyphFontSpec *specs;
+	int rects_size, segs_size, specs_size;
+} Batch;
 
 static void drawLine(Pane *, Line *, int, int, int, int, nsec);
-static void drawCursor(Pane *, Line *, int, int, int, nsec);
+static void drawRun(Pane *, Line *, int, int, int, int, nsec);
+static int getOverhang(Pane *, const Line *, int, int, int *);
+static int findRunEnd(Pane *, const Line *, int, int *);
+static int findRunStart(Pane *, const Line *, int);
+static int findLastRun(Pane *, const Line *, int *);
+static bool isRunBoundary(Pane *, const Line *, int);
+static void flushBatch(Pane *);
+static int cmpColor(const void *, const void *);
+static int cmpText(const void *, const void *);
+static void drawCursor(Pane *, Line *, int, int, int, int, nsec);
+static void drawOverlay(Pane *, Line *, int, nsec);
+static void drawBell(Pane *, Drawable, Region);
+static bool isShown(int, nsec);
+static void saveBlinks(Pane *, nsec);
+static void flipBlinks(Pane *, nsec);
 static void freePixmap(Pane *);
 static void createPixmap(Pane *, int, int);
-static void clearPixmap(Pane *, nsec);
+static void clearPixmap(Pane *);
+static void replayDamage(Pane *, const Damage *);
+static void setCanvas(Pane *, bool);
+static void copyPixmap(Pane *, int, int, int, int, int, int);
+static void fillPixmap(Pane *, Color, int, int, int, int);
+static void fillCanvas(Pane *, Color, int, int, int, int);
+static void addDamage(Pane *, int, int, int, int);
+static bool usesColors(Pane *, int, const uint64_t *);
+static unsigned int hashRun(const Line *, int, int);
+static void buildRunTable(Pane *);
+static Run *findRun(Pane *, const Line *, int, int, int, int);
 
 Pane *
-createPane(DispInfo *dinfo, XFont *xfont, int width, int height, float alpha, int bufsize, char *const cmd[])
+createPane(DispInfo *dinfo, XFont *xfont, int width, int height, float alpha, int bufsize, bool spill, bool shm, char *const cmd[])
 {
 	char *xrm, *str_type, buf[16];
 	XrmDatabase xdb;
@@ -39,15 +135,18 @@ createPane(DispInfo *dinfo, XFont *xfont, int width, int height, float alpha, in
 	Pane *pane = xmalloc(sizeof(Pane));
 
 	*pane = (Pane){
-		.dinfo = dinfo, .xfont = xfont, .depth = 32,
+		.dinfo = dinfo, .xfont = xfont, .depth = 32, .shm = shm,
 		.width = width, .height = height,
 		.xpad = xfont->cw / 2, .ypad = xfont->cw / 2,
 	};
 	memset(&pane->timer_active, 0, TIMER_NUM);
+	pane->damage = XCreateRegion();
+	pane->batch = xmalloc(sizeof(Batch));
+	*pane->batch = (Batch){ 0 };
 
 	/* 端末をオープン */
 	pane->term = openTerm((height - pane->ypad * 2) / xfont->ch,
-			(width - pane->xpad * 2) / xfont->cw, bufsize, cmd[0], cmd);
+			(width - pane->xpad * 2) / xfont->cw, bufsize, spill, cmd[0], cmd);
 	if (!pane->term)
 		errExit("openTerm failed.\n");
 
@@ -76,10 +175,12 @@ createPane(DispInfo *dinfo, XFont *xfont, int width, int height, float alpha, in
 	/* 現在のパレットをデフォルトとして保存 */
 	for (i = 0; i < PALETTE_SIZE; i++)
 		pane->term->def_palette[i] = pane->term->palette[i];
+	pane->palette_b = xmalloc(PALETTE_SIZE * sizeof(Color));
+	memcpy(pane->palette_b, pane->term->palette, PALETTE_SIZE * sizeof(Color));
 
 	/* 描画の準備 */
 	createPixmap(pane, width, height);
-	clearPixmap(pane, pane->time_b);
+	clearPixmap(pane);
 
 	return pane;
 }
@@ -88,28 +189,51 @@ void
 destroyPane(Pane *pane)
 {
 	Line **plines;
+	int i, len;
 
-	closeTerm(pane->term);
-	freePixmap(pane);
+	/* Lineは端末のLinePoolから確保しているので先に返す */
 	for (plines = pane->new_lines; *plines; plines++)
 		freeLine(*plines);
 	free(pane->new_lines);
 	for (plines = pane->old_lines; *plines; plines++)
 		freeLine(*plines);
+	len = plines - pane->old_lines;
 	free(pane->old_lines);
+	free(pane->vers);
+	for (i = 0; i < len; i++)
+		free(pane->runs[i].runs);
+	free(pane->runs);
+	free(pane->table);
+	free(pane->batch->fills);
+	free(pane->batch->texts);
+	free(pane->batch->lines);
+	free(pane->batch->rects);
+	free(pane->batch->segs);
+	free(pane->batch->specs);
+	free(pane->batch);
+	free(pane->blinks);
+	free(pane->palette_b);
+	closeTerm(pane->term);
+	freePixmap(pane);
+	XDestroyRegion(pane->damage);
 	free(pane);
 }
 
+/*
+ * サイズを記録するだけで、実際の変更はdrawPaneで行う
+ *
+ * ウィンドウの端をドラッグしている間は何度も呼ばれるので、
+ * Pixmapはフレームごとに足りなくなったときだけ作り直し、
+ * 端末のサイズはresize_delayの間変化がなくなってから変える。
+ */
 void
-setPaneSize(Pane *pane, int width, int height)
+setPaneSize(Pane *pane, int width, int height, nsec now)
 {
 	pane->width = width;
 	pane->height = height;
-	setWinSize(pane->term, (height - pane->ypad * 2) / pane->xfont->ch,
-			(width - pane->xpad * 2) / pane->xfont->cw, width, height);
-	freePixmap(pane);
-	createPixmap(pane, width, height);
-	clearPixmap(pane, pane->time_b);
+	pane->resize_flag = true;
+	pane->resize_time = now;
+	pane->redraw_flag = true;
 }
 
 void
@@ -135,6 +259,14 @@ mouseEvent(Pane *pane, XEvent *event)
 			(event->xbutton.y - pane->ypad) / pane->xfont->ch);
 }
 
+/* MIT-SHMで送った画像が読み終わられた通知を受け取る */
+bool
+shmCompletionEvent(Pane *pane, XEvent *event)
+{
+	return handleRasterEvent(pane->raster, event) ||
+		handleRasterEvent(pane->oraster, event);
+}
+
 void
 scrollPane(Pane *pane, int n)
 {
@@ -158,6 +290,10 @@ getNextTime(Pane *pane, nsec now)
 	if (now < pane->bell_time)
 		time = pane->bell_time - now;
 
+	/* 端末のサイズを変える時刻 */
+	if (pane->resize_flag)
+		time = MIN(MAX(pane->resize_time + resize_delay - now, 0), time);
+
 #define wait(t, d)      ((d) - (now - (t)) % (d))
 	/* 点滅の時刻 */
 	if (pane->timer_active[BLINK_TIMER])
@@ -175,11 +311,15 @@ int
 drawPane(Pane *pane, nsec now, Line *peline, int pecaret)
 {
 	const nsec bell_duration = 150 * 1000 * 1000;
-	Line *line;
-	int pepos, pewidth, pecaretpos, caretrow;
-	int width, width_b;
-	bool clear_flag = false;
-	int i;
+	const nsec bell_interval = 500 * 1000 * 1000;
+	Line *line, *old, *src;
+	int width, width_b, need_w, need_h, head, tail;
+	int last, next, over, next_over, col;
+	Color fill;
+	bool clear_flag = false, blink_flag = false, bell_flag = false, replay;
+	uint64_t changed[PALETTE_WORDS] = { 0 };
+	int64_t top_b;
+	int i, j;
 
 	/* --- タイマーの処理 --- */
 
@@ -188,44 +328,117 @@ drawPane(Pane *pane, nsec now, Line *peline, int pecaret)
 		(pane->term->cy + pane->scr <= pane->term->sb->rows) &&
 		(!pane->term->ctype || pane->term->ctype % 2);
 
-	/* ベルの消灯時刻をまたいでいたら画面クリア */
+	/* サイズの変化が落ち着いたら再描画 */
+	if (pane->resize_flag && pane->resize_time + resize_delay <= now)
+		pane->redraw_flag = true;
+
+	/* ベルが鳴ったら光らせる (光らせてからbell_intervalの間に鳴ったものはまとめる) */
+	if (pane->bell_cnt != pane->term->bell_cnt) {
+		pane->bell_cnt = pane->term->bell_cnt;
+		if (pane->bell_time - bell_duration + bell_interval <= now) {
+			pane->bell_time = now + bell_duration;
+			bell_flag = true;
+		}
+	}
+
+	/* ベルの消灯時刻をまたいでいたら光らせるのをやめる */
 	if (pane->time_b < pane->bell_time && pane->bell_time <= now)
-		pane->redraw_flag = clear_flag = true;
+		bell_flag = true;
 
-	/* 点滅の切り替わり時刻をまたいでいたら再描画 */
+	/* 点滅の切り替わり時刻をまたいでいたら点滅するものを書き直す */
 #define LIT(T,D) (((T) / (D)) % 2)
 #define CHECK(T,D,B) (pane->timer_active[T] && LIT(pane->time_b - (B), D) != LIT( now - (B), D))
 	if (CHECK(BLINK_TIMER, blink_duration, 0) ||
 	    CHECK(RAPID_TIMER, rapid_duration, 0) ||
 	    CHECK(CARET_TIMER, caret_duration, pane->caret_time))
-		pane->redraw_flag = true;
+		blink_flag = true;
 #undef CHECK
 #undef LIT
 
 	pane->time_b = now;
 
-	if (!pane->redraw_flag)
+	if (!pane->redraw_flag && !blink_flag && !bell_flag)
 		return 0;
 
+	/* 書き換えた範囲を集め直す (前回のカーソルやPreeditの下も写し直す。
+	 * ベルはpresentPaneで重ねるので、点くときと消えるときは全体を写し直す) */
+	XDestroyRegion(pane->damage);
+	pane->damage = XCreateRegion();
+	addDamage(pane, pane->over_x, pane->over_y, pane->over_w, pane->over_h);
+	if (bell_flag)
+		addDamage(pane, 0, 0, pane->width, pane->height);
+	if (!pane->redraw_flag && !blink_flag)
+		return 1;
+
+	/* 点滅の切り替わりだけなら点滅する文字とOverlayだけ書き直す
+	 * (点滅する文字を写しておけなかった場合は全体を書く) */
+	if (!pane->redraw_flag && (pane->blinks_len == 0 || pane->blink || pane->braster)) {
+		flipBlinks(pane, now);
+		drawOverlay(pane, peline, pecaret, now);
+		return 1;
+	}
+
 	/* --- 描画前の処理 --- */
 
-	/* ベルやパレットの更新をチェック */
-	if (pane->bell_cnt != pane->term->bell_cnt) {
-		clear_flag |= pane->bell_time <= now;
-		pane->bell_time = now + bell_duration;
-		pane->bell_cnt = pane->term->bell_cnt;
+	/* サイズの変化が落ち着いたら端末のサイズを変える */
+	if (pane->resize_flag && pane->resize_time + resize_delay <= now) {
+		pane->resize_flag = false;
+		setWinSize(pane->term, (pane->height - pane->ypad * 2) / pane->xfont->ch,
+				(pane->width - pane->xpad * 2) / pane->xfont->cw,
+				pane->width, pane->height);
+		/* 大きすぎるPixmapは作り直す */
+		if (pane->width * 2 < pane->pix_w || pane->height * 2 < pane->pix_h) {
+			freePixmap(pane);
+			createPixmap(pane, PIXMAP_SLACK(pane->width), PIXMAP_SLACK(pane->height));
+		}
+		clear_flag = true;
 	}
-	if (pane->palette_cnt != pane->term->palette_cnt) {
+
+	/* Pixmapが足りなくなったら余裕を持たせて作り直す
+	 * (端末のサイズを変える前は、行のコピー元がはみ出さないよう端末の大きさも収める) */
+	need_w = MAX(pane->width,  pane->xpad * 2 + pane->xfont->cw * (pane->term->sb->cols + 2));
+	need_h = MAX(pane->height, pane->ypad * 2 + pane->xfont->ch * pane->term->sb->rows);
+	if (pane->pix_w < need_w || pane->pix_h < need_h) {
+		freePixmap(pane);
+		createPixmap(pane, PIXMAP_SLACK(need_w), PIXMAP_SLACK(need_h));
 		clear_flag = true;
+	}
+
+	/* パレットの更新をチェック (1フレームの間の変更はまとめて、変わった色だけ集める) */
+	if (pane->palette_cnt != pane->term->palette_cnt) {
+		for (i = 0; i < PALETTE_SIZE; i++)
+			if (pane->palette_b[i] != pane->term->palette[i])
+				changed[i / 64] |= (uint64_t)1 << i % 64;
+		memcpy(pane->palette_b, pane->term->palette, PALETTE_SIZE * sizeof(Color));
 		pane->palette_cnt = pane->term->palette_cnt;
 	}
 
+	/* 背景色が変わったら全体を、他の色は使っている行だけ消して書き直す */
+	if (changed[defbg / 64] & (uint64_t)1 << defbg % 64)
+		clear_flag = true;
+	else if (!clear_flag)
+		for (i = -1; i < pane->term->sb->rows + 2; i++) {
+			if (!usesColors(pane, i, changed))
+				continue;
+			PUT_NUL(OLD_LINE(pane, i), 0);
+			pane->vers[i + 1] = 0;
+			fillPixmap(pane, pane->term->palette[defbg],
+					0, pane->ypad + pane->xfont->ch * i,
+					pane->pix_w, pane->xfont->ch);
+		}
+
+	/* 前回も今回も最下部を表示していれば端末が記録した変化を使える */
+	replay = pane->prevbuf == pane->term->sb && pane->prevscr == 0 && pane->scr == 0;
+
 	/* バッファの切り替えや行の追加を見てスクロール量を更新 */
+	top_b = pane->prevfst - pane->prevscr;
 	pane->scr = (pane->prevbuf != pane->term->sb) ? 0 : pane->scr;
-	pane->scr += (0 < pane->scr) ? pane->term->sb->firstline - pane->prevfst : 0;
-	pane->scr = CLIP(pane->scr, 0, SCROLLMAX(pane->term->sb));
+	pane->scr = CLIP(pane->scr + ((0 < pane->scr) ?
+			pane->term->sb->firstline - pane->prevfst : 0),
+			0, SCROLLMAX(pane->term->sb));
 	pane->prevbuf = pane->term->sb;
 	pane->prevfst = pane->term->sb->firstline;
+	pane->prevscr = pane->scr;
 
 	/* 選択範囲をチェックして変更があったら解除 */
 	if (pane->sel.sb == pane->term->sb && checkSelection(&pane->sel)) {
@@ -235,25 +448,32 @@ drawPane(Pane *pane, nsec now, Line *peline, int pecaret)
 
 	/* --- 端末の内容を描画 --- */
 
+	/* 画面全体を消去する */
 	if (clear_flag)
-		/* 画面全体を消去する */
-		clearPixmap(pane, now);
-	else
-		/* カーソルやPreeditを書く前の状態に戻す */
-		XCopyArea(pane->dinfo->disp, pane->pixbuf, pane->pixmap, pane->gc,
-				pane->clear_x, pane->clear_y,
-				pane->clear_w, pane->clear_h,
-				pane->clear_x, pane->clear_y);
-
-	/* 次回の消去範囲を設定 */
-	pane->clear_x = pane->xpad + pane->xfont->cw * (pane->term->cx - 0.5);
-	pane->clear_y = pane->ypad + pane->xfont->ch * (pane->term->cy + pane->scr);
-	pane->clear_w = pane->xfont->cw * 2;
-	pane->clear_h = pane->xfont->ch;
+		clearPixmap(pane);
+
+	/* 端末が記録した変化をPixmapと前回の行に反映する */
+	if (replay && !clear_flag && pane->term->sb->damage_len <= DAMAGE_MAX)
+		for (i = 0; i < pane->term->sb->damage_len; i++)
+			replayDamage(pane, &pane->term->sb->damage[i]);
+	else if (top_b != pane->term->sb->firstline - pane->scr) {
+		/* 表示する位置がずれたら、共有している同じバージョンの行でも
+		 * 選択範囲の反転が変わりうるので全ての行を書き直す */
+		memset(pane->vers, 0, (pane->term->sb->rows + 3) * sizeof(uint64_t));
+	}
+	pane->term->sb->damage_len = 0;
+
+	/* 選択範囲が変わったら全ての行を書き直す */
+	if (pane->sel.sb    != pane->prevsel.sb    || pane->sel.rect  != pane->prevsel.rect  ||
+	    pane->sel.aline != pane->prevsel.aline || pane->sel.acol  != pane->prevsel.acol  ||
+	    pane->sel.bline != pane->prevsel.bline || pane->sel.bcol  != pane->prevsel.bcol) {
+		memset(pane->vers, 0, (pane->term->sb->rows + 3) * sizeof(uint64_t));
+		pane->prevsel = pane->sel;
+	}
 
 	/* 端末の内容を取得 */
 	getLines(pane->term->sb, pane->new_lines, pane->term->sb->rows + 3,
-			pane->scr + 1, &pane->sel);
+			pane->scr + 1, &pane->sel, pane->vers);
 
 	/* -1行目は画面端をまたいで選択してる場合だけ書く */
 	if ((pane->sel.aline < pane->term->sb->firstline - pane->scr) ==
@@ -261,40 +481,131 @@ drawPane(Pane *pane, nsec now, Line *peline, int pecaret)
 	     pane->term->sb != pane->sel.sb)
 		PUT_NUL(NEW_LINE(pane, -1), 0);
 
-	/* 点滅中フラグを一旦クリア */
+	/* 点滅中フラグと点滅する文字を一旦クリア (点滅する文字のある行は毎回書く) */
 	pane->timer_active[BLINK_TIMER] = pane->timer_active[RAPID_TIMER] = false;
+	pane->blinks_len = 0;
 
-	/* Pixmapに書く */
+	/* Pixmapに書く (前回と同じバージョンの行は飛ばす) */
+	setCanvas(pane, false);
+	pane->table_valid = false;
+	for (i = -1; i < pane->term->sb->rows + 2; i++)
+		ROW_RUNS(pane, i).drawn = false;
+#define SAME_VER(n) (pane->vers[n + 1] && pane->vers[n + 1] == NEW_LINE(pane, n)->ver)
 	for (i = -1; i < pane->term->sb->rows + 2; i++) {
+		if (SAME_VER(i))
+			continue;
 		line = NEW_LINE(pane, i);
+		old = OLD_LINE(pane, i);
+		ROW_RUNS(pane, i).drawn = true;
 
-		/* 前回の方が長い場合の塗りつぶし */
+		/* 行末以降を1つの矩形で塗りつぶす
+		 * (前回の方が長いか、色が変わったか、前回の行末から文字がはみ出していた場合) */
+		findLastRun(pane, old, &over);
 		width   = line ? u32swidth(line->str) : 0;
-		width_b = u32swidth(OLD_LINE(pane, i)->str) + 1;
+		width_b = u32swidth(old->str) + (0 < over);
+		fill    = line ? line->fill : defbg;
+		if (fill != old->fill)
+			width_b = MAX(width_b, pane->term->sb->cols + 2);
+		width_b = MIN(width_b, pane->term->sb->cols + 2);
 		if (width < width_b) {
-			XSetForeground(pane->dinfo->disp, pane->gc,
-					BELLCOLOR(pane->term->palette[defbg]));
-			XFillRectangle(pane->dinfo->disp, pane->pixmap, pane->gc,
+			BATCH_PUSH(pane->batch->fills, pane->batch->fills_len,
+					pane->batch->fills_size, ((struct BatchFill){
+					fill < PALETTE_SIZE ? pane->term->palette[fill] : fill, {
 					pane->xpad + pane->xfont->cw * width,
+					pane->ypad + pane->xfont->ch * i,
+					pane->xfont->cw * (width_b - width),
+					pane->xfont->ch } }));
+			addDamage(pane, pane->xpad + pane->xfont->cw * width,
 					pane->ypad + pane->xfont->ch * i,
 					pane->xfont->cw * (width_b - width),
 					pane->xfont->ch);
 		}
 
-		/* 行を書く */
-		if (line)
+		/* 行を書く (前回書いた内容からの書き換え範囲が分かればその範囲だけ) */
+		if (line && pane->vers[i + 1] && pane->vers[i + 1] == line->basever) {
+			/* 行末からはみ出すランは塗りつぶしたら書き直す */
+			last = findLastRun(pane, line, &over);
+			over = width < width_b ? over : 0;
+			if (line->dirty_tail <= line->dirty_head && over == 0)
+				continue;
+
+			/* 書き換え範囲をランの境界まで広げる (前回のランの終わりまでも含める) */
+			for (head = 0; line->str[head] &&
+			    (next = findRunEnd(pane, line, head, &next_over)) <= line->dirty_head; head = next);
+			/* 前回のランが左にはみ出していた所から書き直す (今回と前回のランの境界まで戻る) */
+			for (col = u32snwidth(line->str, head); (j = findRunStart(pane, line,
+			    findRunStart(pane, old, col))) < col; col = j);
+			head = MIN(getIndex(line->str, col), u32slen(line->str));
+			tail = line->dirty_tail < u32slen(line->str) ?
+				u32snwidth(line->str, line->dirty_tail) : pane->term->sb->cols + 2;
+			for (j = 0, col = 0; old->str[j] && col < tail; j = next) {
+				next = findRunEnd(pane, old, j, &next_over);
+				col += u32snwidth(&old->str[j], next - j);
+			}
+			tail = MAX(tail, col);
+			if (0 < over) {
+				head = MIN(head, last);
+				tail = pane->term->sb->cols + 2;
+			}
+			drawLine(pane, line, i, 0, tail, u32snwidth(line->str, head), now);
+		} else if (line) {
 			drawLine(pane, line, i, 0, pane->term->sb->cols + 2, 0, now);
+		}
 	}
 
-	/* 書いた文字とPixmapの状態を記録 */
-	for (i = -1; i < pane->term->sb->rows + 2; i++)
-		linecpy(OLD_LINE(pane, i), NEW_LINE(pane, i));
-	XCopyArea(pane->dinfo->disp, pane->pixmap, pane->pixbuf, pane->gc,
-			0, 0, pane->width, pane->height, 0, 0);
+	/* 溜めた背景・文字・線をまとめて書く
+	 * (行のコピー元はまだ書いていない行なので、送るのを最後にしても変わらない) */
+	flushBatch(pane);
+	saveBlinks(pane, now);
+
+	/* 書いた文字とPixmapの状態を記録
+	 * (次回は今回書いた内容からの書き換え範囲を使えるよう、端末の行も起点にする) */
+	for (i = -1; i < pane->term->sb->rows + 2; i++) {
+		if (SAME_VER(i))
+			continue;
+		line = NEW_LINE(pane, i);
+		linecpy(OLD_LINE(pane, i), line);
+		if ((src = getLine(pane->term->sb, i - pane->scr)))
+			cleanLine(src);
+
+		/* 画面内の行だけバージョンを覚える (点滅する行は毎回書く) */
+		for (j = 0; line->str[j] && !(line->attr[j] & (BLINK | RAPID)); j++);
+		if (0 <= i && i < pane->term->sb->rows && line->str[j] == L'\0')
+			pane->vers[i + 1] = line->ver;
+		else
+			pane->vers[i + 1] = 0;
+	}
+#undef SAME_VER
 
 	/* --- カーソル/Preeditの描画 --- */
+	drawOverlay(pane, peline, pecaret, now);
+
+	pane->redraw_flag = false;
+
+	return 1;
+}
+
+/*
+ * カーソルとPreeditを書く
+ * Pixmapには書かず、行の内容を写したOverlayに重ねて書く
+ */
+void
+drawOverlay(Pane *pane, Line *peline, int pecaret, nsec now)
+{
+	int pepos, pewidth, pecaretpos, caretrow;
+
+	pane->over_w = 0;
+	pane->over_y = pane->ypad + pane->xfont->ch * (u32slen(peline->str) ?
+			pane->term->cy : pane->term->cy + pane->scr);
+	pane->over_h = pane->xfont->ch;
+	if (pane->raster)
+		copyRaster(pane->oraster, pane->raster,
+				0, pane->over_y, pane->pix_w, pane->over_h, 0, 0);
+	else
+		XCopyArea(pane->dinfo->disp, pane->pixmap, pane->overlay, pane->gc,
+				0, pane->over_y, pane->pix_w, pane->over_h, 0, 0);
+	setCanvas(pane, true);
 
-	XSetForeground(pane->dinfo->disp, pane->gc, pane->term->palette[deffg]);
 	if (u32slen(peline->str)) {
 		/* Preeditの幅とキャレットのPreedit内での位置を取得 */
 		pewidth = u32swidth(peline->str);
@@ -308,63 +619,128 @@ drawPane(Pane *pane, nsec now, Line *peline, int pecaret)
 
 		/* Preeditとカーソルの描画 */
 		drawLine(pane, peline, pane->term->cy, pepos, pewidth, 0, now);
-		drawCursor(pane, peline, pane->term->cy, pepos + pecaretpos, 6, now);
+		flushBatch(pane);
+		drawCursor(pane, peline, pane->term->cy, pepos, pecaretpos, 6, now);
 
-		/* 次回の消去範囲を変更 */
-		pane->clear_x = pane->xpad + pane->xfont->cw * (pepos - 0.5);
-		pane->clear_w = pane->xfont->cw * (pewidth + 1);
+		/* Overlayの範囲をPreedit全体にする */
+		pane->over_x = pane->xpad + pane->xfont->cw * (pepos - 0.5);
+		pane->over_w = pane->xfont->cw * (pewidth + 1);
 	} else if (1 <= pane->term->dec[25] && pane->term->cx < pane->term->sb->cols + 2) {
 		/* カーソルの描画 */
 		caretrow = pane->term->cy + pane->scr;
-		line = NEW_LINE(pane, caretrow);
 		if (caretrow <= pane->term->sb->rows)
-			drawCursor(pane, line, caretrow, pane->term->cx, pane->term->ctype, now);
+			drawCursor(pane, NEW_LINE(pane, caretrow), caretrow,
+					0, pane->term->cx, pane->term->ctype, now);
 	}
+	setCanvas(pane, false);
+}
 
-	pane->redraw_flag = false;
+/*
+ * Pixmapのregionの範囲をdstに写し、その上にカーソルとPreeditを重ねる
+ */
+void
+presentPane(Pane *pane, Drawable dst, GC gc, Region region)
+{
+	Display *disp = pane->dinfo->disp;
+	XRectangle box;
 
-	return 1;
+	XClipBox(region, &box);
+	XSetRegion(disp, gc, region);
+	if (pane->raster)
+		putRaster(pane->raster, dst, gc, box.x, box.y, box.width, box.height, box.x, box.y);
+	else
+		XCopyArea(disp, pane->pixmap, dst, gc, box.x, box.y, box.width, box.height, box.x, box.y);
+	XSetClipMask(disp, gc, None);
+
+	if (0 < pane->over_w && pane->raster)
+		putRaster(pane->oraster, dst, gc, pane->over_x, 0,
+				pane->over_w, pane->over_h, pane->over_x, pane->over_y);
+	else if (0 < pane->over_w)
+		XCopyArea(disp, pane->overlay, dst, gc, pane->over_x, 0,
+				pane->over_w, pane->over_h, pane->over_x, pane->over_y);
+
+	/* ベルが鳴っている間は写した範囲に白を薄く重ねる */
+	if (pane->time_b < pane->bell_time)
+		drawBell(pane, dst, region);
+}
+
+/*
+ * 写した範囲とOverlayにベルの光を重ねる
+ *
+ * Pixmapや前回の行には手を付けないので、消えるときは写し直すだけで済む。
+ * XRenderが使えなければ光らせない。
+ */
+void
+drawBell(Pane *pane, Drawable dst, Region region)
+{
+	const XRenderColor color = { 0x1333, 0x1333, 0x1333, 0x1333 };
+	Display *disp = pane->dinfo->disp;
+	XRectangle rect = { pane->over_x, pane->over_y, pane->over_w, pane->over_h };
+	Picture pict;
+	Region bell;
+
+	if (!pane->xfont->render)
+		return;
+
+	bell = XCreateRegion();
+	XUnionRegion(region, bell, bell);
+	if (0 < pane->over_w)
+		XUnionRectWithRegion(&rect, bell, bell);
+
+	pict = XRenderCreatePicture(disp, dst,
+			XRenderFindVisualFormat(disp, pane->dinfo->visual), 0, NULL);
+	XRenderSetPictureClipRegion(disp, pict, bell);
+	XRenderFillRectangle(disp, PictOpOver, pict, &color, 0, 0, pane->width, pane->height);
+	XRenderFreePicture(disp, pict);
+	XDestroyRegion(bell);
 }
 
 void
 drawLine(Pane *pane, Line *line, int row, int col, int width, int pos, nsec now)
 {
-	int next, i = getIndex(line->str, pos);
+	int next, over, j, i = getIndex(line->str, pos);
 	int x, y, w;
-	int attr, fg, bg, blink, rapid;
-	XftColor xc;
-	Color fc, bc;
-	int sl;
+	Run *run;
 
 	if (width <= pos || line->str[i] == L'\0')
 		return;
 
-	/* 同じ属性の文字はまとめて処理する */
-	next = findNextSGR(line, i);
-	drawLine(pane, line, row, col, width, pos + u32snwidth(&line->str[i], next - i), now);
+	/* はみ出しでつながった文字はまとめて処理する */
+	next = findRunEnd(pane, line, i, &over);
+	w = u32snwidth(&line->str[i], next - i);
+	drawLine(pane, line, row, col, width, pos + w, now);
 
 	/* 座標 */
 	x = pane->xpad + (col + pos) * pane->xfont->cw;
-	y = pane->ypad + row * pane->xfont->ch;
-	w = pane->xfont->cw * u32snwidth(&line->str[i], next - i);
-
-	/* 変化無し・コピー・書き直しの分岐 */
-#define LINE_CMP(R) linecmp(line, OLD_LINE(pane, R), pos, next - i)
-	if (line->attr[i] & (ITALIC | BLINK | RAPID))
-		sl = pane->term->sb->rows;
-	else if (BETWEEN(row, -1, pane->term->sb->rows + 2) && LINE_CMP(row))
-		return;
-	else
-		for (sl = 0; sl < pane->term->sb->rows; sl++)
-			if (LINE_CMP(sl))
-				break;
-	if (sl < pane->term->sb->rows) {
-		XCopyArea(pane->dinfo->disp, pane->pixbuf, pane->pixmap, pane->gc,
-				x, pane->ypad + (sl) * pane->xfont->ch,
-				w, pane->xfont->ch, x, y);
+	y = pane->ypad + row * pane->xfont->ch - pane->canvas_y;
+
+	/* 変化無し・コピー・書き直しの分岐 (端末の行だけ前回の内容から探す。
+	 * 点滅する文字と、行末の塗りつぶしに重なるはみ出しがあるものは書き直す) */
+	for (j = i; j < next && !(line->attr[j] & (BLINK | RAPID)); j++);
+	if (line == NEW_LINE(pane, row) && j == next && !(over && line->str[next] == L'\0') &&
+	    (run = findRun(pane, line, i, next - i, row, col + pos))) {
+		if (run->row != row || run->col != col + pos)
+			copyPixmap(pane, pane->xpad + run->col * pane->xfont->cw,
+					pane->ypad + run->row * pane->xfont->ch,
+					pane->xfont->cw * w, pane->xfont->ch, x, y);
 		return;
 	}
-#undef LINE_CMP
+
+	/* 同じ属性の文字ごとに書く */
+	for (j = i; j < next; j = findNextSGR(line, j))
+		drawRun(pane, line, j, findNextSGR(line, j),
+				x + pane->xfont->cw * u32snwidth(&line->str[i], j - i), y, now);
+}
+
+/* lineのiからnextまでの同じ属性の文字をx, yに書く */
+void
+drawRun(Pane *pane, Line *line, int i, int next, int x, int y, nsec now)
+{
+	const int w = pane->xfont->cw * u32snwidth(&line->str[i], next - i);
+	int attr, fg, bg, left, right;
+	bool blinking;
+	Color fc, bc;
+	Batch *b = pane->batch;
 
 	/* 前処理 */
 	fg = line->attr[i] & NEGA ? line->bg[i] : line->fg[i];  /* 反転 */
@@ -376,55 +752,288 @@ drawLine(Pane *pane, Line *line, int row, int col, int width, int pos, nsec now)
 	if (line->attr[i] & FAINT)                              /* 細字 */
 		fc = BLEND_COLOR(fc, 0.6, bc, 0.4);
 
-	/* 背景を塗る */
-	XSetForeground(pane->dinfo->disp, pane->gc, BELLCOLOR(bc));
-	XFillRectangle(pane->dinfo->disp, pane->pixmap, pane->gc, x, y, w, pane->xfont->ch);
+	/* 背景を塗る (文字ははみ出す分も含めて書き換えた範囲にする。
+	 * 行頭の文字は左の余白にははみ出させない) */
+	right = getOverhang(pane, line, i, next, &left);
+	left = 0 < i ? left : 0;
+	BATCH_PUSH(b->fills, b->fills_len, b->fills_size, ((struct BatchFill){
+			bc, { x, y, w, pane->xfont->ch } }));
+	if (ON_PIXMAP(pane))
+		addDamage(pane, x - left, y, left + w + pane->xfont->cw, pane->xfont->ch);
 
-	/* 非表示・点滅 */
+	/* 非表示・点滅 (Pixmapでは表示した状態で書いておき、saveBlinksで消す) */
 	pane->timer_active[BLINK_TIMER] |= line->attr[i] & BLINK;
 	pane->timer_active[RAPID_TIMER] |= line->attr[i] & RAPID;
-	blink = line->attr[i] & BLINK ? ((now / blink_duration) % 2) ? 2 : 0 : 1;
-	rapid = line->attr[i] & RAPID ? ((now / rapid_duration) % 2) ? 2 : 0 : 1;
-	if (line->attr[i] & CONCEAL || blink + rapid < 2)
+	blinking = (line->attr[i] & (BLINK | RAPID)) && ON_PIXMAP(pane);
+	if (line->attr[i] & CONCEAL || (!blinking && !isShown(line->attr[i], now)))
 		return;
+	if (blinking)
+		BATCH_PUSH(pane->blinks, pane->blinks_len, pane->blinks_size, ((Blink){
+				x, y, w, bc, line->attr[i] & (BLINK | RAPID), true }));
 
 	y += pane->xfont->ascent;
 
-	/* 色をXftColorに変換 */
-	xc.color.red   =   RED(fc) << 8;
-	xc.color.green = GREEN(fc) << 8;
-	xc.color.blue  =  BLUE(fc) << 8;
-	xc.color.alpha = 0xffff;
-
-	/* 文字を書く */
+	/* 文字を書く (はみ出しはgetOverhangで求めた幅で切る) */
 	attr = FONT_NONE;
 	attr |= line->attr[i] & BOLD   ? FONT_BOLD   : FONT_NONE;
 	attr |= line->attr[i] & ITALIC ? FONT_ITALIC : FONT_NONE;
-	drawXFontString(pane->draw, &xc, pane->xfont, attr, x, y, w + pane->xfont->cw,
-			&line->str[i], next - i);
+	BATCH_PUSH(b->texts, b->texts_len, b->texts_size, ((struct BatchText){
+			fc, attr, x, y, left, w + right, &line->str[i], next - i }));
 
 	/* 後処理 */
-	XSetForeground(pane->dinfo->disp, pane->gc, fc);
+#define LINE(Y) BATCH_PUSH(b->lines, b->lines_len, b->lines_size,\
+		((struct BatchLine){ fc, { x, (Y), x + w - 1, (Y) } }))
 	if (line->attr[i] & (ULINE | DULINE))   /* 下線 */
-		XDrawLine(pane->dinfo->disp, pane->pixmap, pane->gc, x, y + 1, x + w - 1, y + 1);
+		LINE(y + 1);
 	if (line->attr[i] & DULINE)             /* 二重下線 */
-		XDrawLine(pane->dinfo->disp, pane->pixmap, pane->gc, x, y + 3, x + w - 1, y + 3);
+		LINE(y + 3);
 	y -= pane->xfont->ascent * 0.4;         /* 取消 */
 	if (line->attr[i] & STRIKE)
-		XDrawLine(pane->dinfo->disp, pane->pixmap, pane->gc, x, y + 1, x + w - 1, y + 1);
+		LINE(y + 1);
+#undef LINE
+}
+
+/*
+ * lineのiからnextまでの同じ属性の文字が右のセルにはみ出す幅を返し、
+ * 左のセルにはみ出す幅をleftに入れる
+ * (書かない文字と、消したときに残らないよう切る点滅する文字ははみ出さない)
+ */
+int
+getOverhang(Pane *pane, const Line *line, int i, int next, int *left)
+{
+	int attr, right;
+
+	*left = 0;
+	if (line->attr[i] & (CONCEAL | BLINK | RAPID))
+		return 0;
+	attr = FONT_NONE;
+	attr |= line->attr[i] & BOLD   ? FONT_BOLD   : FONT_NONE;
+	attr |= line->attr[i] & ITALIC ? FONT_ITALIC : FONT_NONE;
+
+	getXFontOverhang(pane->xfont, attr, &line->str[i], next - i, left, &right);
+	*left = MIN(*left, pane->xfont->cw);
+
+	return MIN(right, pane->xfont->cw);
+}
+
+/*
+ * iから始まるランの終わりを返す
+ *
+ * 右にはみ出す文字は次の属性の文字と、左にはみ出す文字は前の属性の文字と
+ * まとめて1つのランにするので、ランのPixmap上の内容はその中の文字だけで決まる。
+ * overには最後の文字が右にはみ出す幅を入れる (0でないのは行末の場合だけ)。
+ */
+int
+findRunEnd(Pane *pane, const Line *line, int i, int *over)
+{
+	int next, left;
+
+	for (;; i = next) {
+		next = findNextSGR(line, i);
+		*over = getOverhang(pane, line, i, next, &left);
+		if (line->str[next] == L'\0')
+			return next;
+		getOverhang(pane, line, next, findNextSGR(line, next), &left);
+		if (*over == 0 && left == 0)
+			return next;
+	}
+}
+
+/* colを含むランの先頭の列を返す (行末より後ろならcolのまま) */
+int
+findRunStart(Pane *pane, const Line *line, int col)
+{
+	int i, next, over, c, w;
+
+	for (i = 0, c = 0; line->str[i]; i = next, c += w) {
+		next = findRunEnd(pane, line, i, &over);
+		w = u32snwidth(&line->str[i], next - i);
+		if (col < c + w)
+			return c;
+	}
+
+	return col;
+}
+
+/* 行の最後のランの位置を返し、行末からはみ出す幅をoverに入れる */
+int
+findLastRun(Pane *pane, const Line *line, int *over)
+{
+	int i, next;
+
+	*over = 0;
+	for (i = 0; line->str[i]; i = next)
+		if (line->str[next = findRunEnd(pane, line, i, over)] == L'\0')
+			return i;
+
+	return 0;
+}
+
+/* colがランの境界か (左右のランのはみ出しがかからないか) */
+bool
+isRunBoundary(Pane *pane, const Line *line, int col)
+{
+	int i = 0, next, c = 0, over = 0;
+
+	while (line->str[i] && c < col) {
+		next = findRunEnd(pane, line, i, &over);
+		c += u32snwidth(&line->str[i], next - i);
+		i = next;
+	}
+
+	/* ランの途中でなく、行末より後ろなら行末からのはみ出しにかからない */
+	if (c != col)
+		return c < col && line->str[i] == L'\0';
+	return line->str[i] != L'\0' || over == 0;
+}
+
+/*
+ * drawLineで溜めたものを書き込み先に送る
+ *
+ * 背景は色ごとにXFillRectangles、線は色ごとにXDrawSegmentsで書く。
+ * 文字は行と色で並べ替え、XRenderが使えれば行の中の色ごとに
+ * 1回のXftDrawGlyphFontSpecで書く。はみ出しはその行の文字の範囲で切り、
+ * 上下の行にかからないようにする。
+ * クライアント側で描く場合は溜めた順にRasterに渡してまとめて書かせる。
+ */
+void
+flushBatch(Pane *pane)
+{
+	Display *disp = pane->dinfo->disp;
+	XFont *xfont = pane->xfont;
+	Raster *raster = pane->canvas_raster;
+	Batch *b = pane->batch;
+	XftColor xc;
+	int i, j, k, n, len;
+
+	if (raster) {
+		for (i = 0; i < b->fills_len; i++)
+			pushRasterFill(raster, b->fills[i].color, b->fills[i].rect.x,
+					b->fills[i].rect.y, b->fills[i].rect.width,
+					b->fills[i].rect.height);
+		for (i = 0; i < b->texts_len; i++) {
+			if (b->specs_size < b->texts[i].len) {
+				b->specs_size = MAX(b->specs_size * 2, b->texts[i].len);
+				b->specs = xrealloc(b->specs, b->specs_size * sizeof(XftGlyphFontSpec));
+			}
+			n = getXFontGlyphs(xfont, b->texts[i].attr, b->texts[i].x, b->texts[i].y,
+					b->texts[i].str, b->texts[i].len, b->specs);
+			pushRasterGlyphs(raster, b->texts[i].color, b->specs, n, (XRectangle){
+					b->texts[i].x - b->texts[i].left, b->texts[i].y - xfont->ascent,
+					b->texts[i].left + b->texts[i].w, xfont->ch });
+		}
+		for (i = 0; i < b->lines_len; i++)
+			pushRasterFill(raster, b->lines[i].color,
+					b->lines[i].seg.x1, b->lines[i].seg.y1,
+					b->lines[i].seg.x2 - b->lines[i].seg.x1 + 1,
+					b->lines[i].seg.y2 - b->lines[i].seg.y1 + 1);
+		flushRaster(raster);
+		b->fills_len = b->texts_len = b->lines_len = 0;
+		return;
+	}
+
+	/* 作業用の配列を確保 */
+	len = MAX(b->fills_len, b->texts_len);
+	if (b->rects_size < len) {
+		b->rects_size = MAX(b->rects_size * 2, len);
+		b->rects = xrealloc(b->rects, b->rects_size * sizeof(XRectangle));
+	}
+
+	/* 背景 */
+	qsort(b->fills, b->fills_len, sizeof(b->fills[0]), cmpColor);
+	for (i = 0; i < b->fills_len; i = j) {
+		for (j = i, n = 0; j < b->fills_len && b->fills[j].color == b->fills[i].color; j++)
+			b->rects[n++] = b->fills[j].rect;
+		XSetForeground(disp, pane->gc, b->fills[i].color);
+		XFillRectangles(disp, pane->canvas, pane->gc, b->rects, n);
+	}
+
+	/* 文字 */
+	qsort(b->texts, b->texts_len, sizeof(b->texts[0]), cmpText);
+	for (i = 0; i < b->texts_len; i = k) {
+		for (k = i, n = 0; k < b->texts_len && b->texts[k].y == b->texts[i].y; k++)
+			b->rects[n++] = (XRectangle){ b->texts[k].x - b->texts[k].left,
+				b->texts[k].y - xfont->ascent,
+				b->texts[k].left + b->texts[k].w, xfont->ch };
+
+		/* 行ごとにその行の文字の範囲で切る */
+		if (xfont->render)
+			XftDrawSetClipRectangles(pane->canvas_draw, 0, 0, b->rects, n);
+
+		/* 行の中では色ごとにまとめて書く */
+		for (; i < k; i = j) {
+			xc.color.red   =   RED(b->texts[i].color) << 8;
+			xc.color.green = GREEN(b->texts[i].color) << 8;
+			xc.color.blue  =  BLUE(b->texts[i].color) << 8;
+			xc.color.alpha = 0xffff;
+
+			/* XRenderが使えなければ並びごとに書く */
+			if (!xfont->render) {
+				drawXFontString(pane->canvas_draw, &xc, xfont, b->texts[i].attr,
+						b->texts[i].x, b->texts[i].y, b->texts[i].left, b->texts[i].w,
+						b->texts[i].str, b->texts[i].len);
+				j = i + 1;
+				continue;
+			}
+
+			for (j = i, len = 0; j < k && b->texts[j].color == b->texts[i].color; j++)
+				len += b->texts[j].len;
+			if (b->specs_size < len) {
+				b->specs_size = MAX(b->specs_size * 2, len);
+				b->specs = xrealloc(b->specs, b->specs_size * sizeof(XftGlyphFontSpec));
+			}
+			for (j = i, n = 0; j < k && b->texts[j].color == b->texts[i].color; j++)
+				n += getXFontGlyphs(xfont, b->texts[j].attr, b->texts[j].x, b->texts[j].y,
+						b->texts[j].str, b->texts[j].len, &b->specs[n]);
+			XftDrawGlyphFontSpec(pane->canvas_draw, &xc, b->specs, n);
+		}
+	}
+
+	/* 線 */
+	if (b->segs_size < b->lines_len) {
+		b->segs_size = MAX(b->segs_size * 2, b->lines_len);
+		b->segs = xrealloc(b->segs, b->segs_size * sizeof(XSegment));
+	}
+	qsort(b->lines, b->lines_len, sizeof(b->lines[0]), cmpColor);
+	for (i = 0; i < b->lines_len; i = j) {
+		for (j = i, n = 0; j < b->lines_len && b->lines[j].color == b->lines[i].color; j++)
+			b->segs[n++] = b->lines[j].seg;
+		XSetForeground(disp, pane->gc, b->lines[i].color);
+		XDrawSegments(disp, pane->canvas, pane->gc, b->segs, n);
+	}
+
+	b->fills_len = b->texts_len = b->lines_len = 0;
+}
+
+int
+cmpColor(const void *a, const void *b)
+{
+	const Color c1 = *(const Color *)a, c2 = *(const Color *)b;
+
+	return (c1 > c2) - (c1 < c2);
+}
+
+int
+cmpText(const void *a, const void *b)
+{
+	const struct BatchText *t1 = a, *t2 = b;
+
+	if (t1->y != t2->y)
+		return (t1->y > t2->y) - (t1->y < t2->y);
+	return cmpColor(a, b);
 }
 
 void
-drawCursor(Pane *pane, Line *line, int row, int col, int type, nsec now)
+drawCursor(Pane *pane, Line *line, int row, int col, int pos, int type, nsec now)
 {
 	int index, col2, width;
-	getCharCnt(line->str, col, &index, &col2, &width);
-	char32_t *c = index < u32slen(line->str) ? &line->str[index] : (char32_t *)L" ";
-	const int x = pane->xpad + col * pane->xfont->cw;
-	const int y = pane->ypad + row * pane->xfont->ch;
+	getCharCnt(line->str, pos, &index, &col2, &width);
+	char32_t c[2] = { index < u32slen(line->str) ? line->str[index] : L' ', L'\0' };
+	const int x = pane->xpad + (col + col2) * pane->xfont->cw;
+	const int y = pane->ypad + row * pane->xfont->ch - pane->canvas_y;
 	const int cw = pane->xfont->cw * width - 1;
 	const int ch = pane->xfont->ch;
-	const DispInfo *dinfo = pane->dinfo;
+	const Color color = pane->term->palette[deffg];
 	int attr;
 	Line cursor;
 
@@ -433,41 +1042,442 @@ drawCursor(Pane *pane, Line *line, int row, int col, int type, nsec now)
 	    ((now - pane->caret_time) / caret_duration) % 2)
 		return;
 
-	XSetForeground(dinfo->disp, pane->gc, BELLCOLOR(pane->term->palette[deffg]));
-
 	switch (type) {
 	default: case 0: case 1: case 2: /* ブロック */
 		if (pane->focus) {
 			attr = index < u32slen(line->str) ? line->attr[index] : 0;
 			cursor = (Line){c, &attr, &defbg, &deffg};
-			drawLine(pane, &cursor, row, col2, 1, 0, now);
+			drawLine(pane, &cursor, row, col + col2, 1, 0, now);
+			flushBatch(pane);
 		} else {
-			XDrawRectangle(dinfo->disp, pane->pixmap, pane->gc, x, y, cw, ch - 1);
-			XDrawPoint(dinfo->disp, pane->pixmap, pane->gc, x + cw, y + ch - 1);
+			fillCanvas(pane, color, x, y, cw + 1, 1);
+			fillCanvas(pane, color, x, y + ch - 1, cw + 1, 1);
+			fillCanvas(pane, color, x, y, 1, ch);
+			fillCanvas(pane, color, x + cw, y, 1, ch);
 		}
 		break;
 	case 3: case 4: /* 下線 */
-		XFillRectangle(dinfo->disp, pane->pixmap, pane->gc,
-				x, y + 1 + pane->xfont->ascent, cw, ch * 0.1);
+		fillCanvas(pane, color, x, y + 1 + pane->xfont->ascent, cw, ch * 0.1);
 		break;
 	case 5: case 6: /* 縦線 */
-		XFillRectangle(dinfo->disp, pane->pixmap, pane->gc,
-				x - 1, y, ch * 0.1, ch);
+		fillCanvas(pane, color, x - 1, y, ch * 0.1, ch);
 		break;
 	}
 
-	/* 次回の消去範囲を変更 */
-	pane->clear_x = pane->xpad + pane->xfont->cw * (col2 - 0.5);
-	pane->clear_w = cw + pane->xfont->cw;
+	/* Overlayの範囲を設定 */
+	pane->over_x = pane->xpad + pane->xfont->cw * (col + col2 - 0.5);
+	pane->over_w = cw + pane->xfont->cw;
+}
+
+/* 点滅する属性の文字がnowの時点で表示されるか */
+bool
+isShown(int attr, nsec now)
+{
+	const int blink = attr & BLINK ? ((now / blink_duration) % 2) ? 2 : 0 : 1;
+	const int rapid = attr & RAPID ? ((now / rapid_duration) % 2) ? 2 : 0 : 1;
+
+	return 2 <= blink + rapid;
+}
+
+/*
+ * 表示した状態で書いた点滅する文字をblinkに写し、今消えているものは消す
+ *
+ * blinkはPixmapと同じ大きさで、点滅する文字が出てきたときに作る。
+ */
+void
+saveBlinks(Pane *pane, nsec now)
+{
+	const DispInfo *di = pane->dinfo;
+	const int ch = pane->xfont->ch;
+	Blink *bl;
+
+	if (pane->blinks_len == 0)
+		return;
+
+	if (pane->raster && !pane->braster)
+		pane->braster = openRaster(di->disp, di->visual, pane->depth,
+				pane->pix_w, pane->pix_h);
+	else if (!pane->raster && !pane->blink)
+		pane->blink = XCreatePixmap(di->disp, di->root,
+				pane->pix_w, pane->pix_h, pane->depth);
+
+	for (bl = pane->blinks; bl < pane->blinks + pane->blinks_len; bl++) {
+		if (pane->braster)
+			copyRaster(pane->braster, pane->raster,
+					bl->x, bl->y, bl->w, ch, bl->x, bl->y);
+		else if (pane->blink)
+			XCopyArea(di->disp, pane->pixmap, pane->blink, pane->gc,
+					bl->x, bl->y, bl->w, ch, bl->x, bl->y);
+		bl->shown = true;
+	}
+
+	flipBlinks(pane, now);
+}
+
+/* 点滅する文字をnowの時点の状態に書き換える */
+void
+flipBlinks(Pane *pane, nsec now)
+{
+	const int ch = pane->xfont->ch;
+	Blink *bl;
+	bool shown;
+
+	for (bl = pane->blinks; bl < pane->blinks + pane->blinks_len; bl++) {
+		shown = isShown(bl->attr, now);
+		if (shown == bl->shown)
+			continue;
+		bl->shown = shown;
+
+		if (!shown)
+			fillPixmap(pane, bl->bg, bl->x, bl->y, bl->w, ch);
+		else if (pane->braster)
+			copyRaster(pane->raster, pane->braster,
+					bl->x, bl->y, bl->w, ch, bl->x, bl->y);
+		else
+			XCopyArea(pane->dinfo->disp, pane->blink, pane->pixmap, pane->gc,
+					bl->x, bl->y, bl->w, ch, bl->x, bl->y);
+		addDamage(pane, bl->x, bl->y, bl->w, ch);
+	}
+}
+
+/*
+ * 端末での行のスクロールや消去をPixmapの上で再現する
+ *
+ * Pixmapと一緒に前回の行(old_lines)も同じように変える。
+ * 書かれている内容と前回の行が食い違わない限り正しさは差分で保たれるので、
+ * 文字の境界が合わないなど再現しにくい場合は何もしない。
+ */
+void
+replayDamage(Pane *pane, const Damage *dmg)
+{
+	const int cw = pane->xfont->cw, ch = pane->xfont->ch;
+	const int cols = pane->term->sb->cols + 2;
+	const int area = dmg->last - dmg->first + 1;
+	const int x = pane->xpad + cw * dmg->col;
+	Line *new_tmp[area], *old_tmp[area], *old;
+	uint64_t vers_tmp[area];
+	RowRuns runs_tmp[area];
+	int i, j, r, n, index, col, width;
+
+	switch (dmg->type) {
+	case DAMAGE_SCROLL:
+		n = dmg->num;
+
+		/* 残る行をずらす */
+		if (abs(n) < area)
+			copyPixmap(pane, 0, pane->ypad + ch * (dmg->first + MAX(n, 0)),
+					pane->pix_w, ch * (area - abs(n)),
+					0, pane->ypad + ch * (dmg->first + MAX(-n, 0)));
+
+		/* 行とバージョンとRunの並びも同じように回す */
+		for (i = 0; i < area; i++) {
+			j = ((i + n) % area + area) % area;
+			new_tmp[i]  = NEW_LINE(pane, dmg->first + j);
+			old_tmp[i]  = OLD_LINE(pane, dmg->first + j);
+			vers_tmp[i] = pane->vers[dmg->first + j + 1];
+			runs_tmp[i] = ROW_RUNS(pane, dmg->first + j);
+		}
+		for (i = 0; i < area; i++) {
+			NEW_LINE(pane, dmg->first + i) = new_tmp[i];
+			OLD_LINE(pane, dmg->first + i) = old_tmp[i];
+			pane->vers[dmg->first + i + 1] = vers_tmp[i];
+			ROW_RUNS(pane, dmg->first + i) = runs_tmp[i];
+		}
+
+		/* 入ってきた行は空にする */
+		for (i = 0 < n ? area - n : 0; i < (0 < n ? area : -n); i++) {
+			PUT_NUL(OLD_LINE(pane, dmg->first + i), 0);
+			pane->vers[dmg->first + i + 1] = 0;
+		}
+		fillPixmap(pane, pane->term->palette[defbg],
+				0, pane->ypad + ch * (dmg->first + (0 < n ? area - n : 0)),
+				pane->pix_w, ch * abs(n));
+		break;
+
+	case DAMAGE_CLEAR:
+		for (r = dmg->first; r <= dmg->last; r++) {
+			/* 文字やランの途中から消す場合は再現しない */
+			old = OLD_LINE(pane, r);
+			getCharCnt(old->str, dmg->col, &index, &col, &width);
+			pane->vers[r + 1] = 0;
+			if (col != dmg->col || !isRunBoundary(pane, old, dmg->col))
+				continue;
+
+			clearToEnd(old, dmg->col, dmg->bg);
+			fillPixmap(pane, dmg->bg < PALETTE_SIZE ?
+					pane->term->palette[dmg->bg] : dmg->bg,
+					x, pane->ypad + ch * r, cw * (cols - dmg->col), ch);
+		}
+		break;
+
+	case DAMAGE_INSERT:
+	case DAMAGE_DELETE:
+		/* 文字やランの境界でない場合と行末より後ろの場合は再現しない */
+		old = OLD_LINE(pane, dmg->first);
+		pane->vers[dmg->first + 1] = 0;
+		getCharCnt(old->str, dmg->col, &index, &col, &width);
+		if (col != dmg->col || u32swidth(old->str) <= dmg->col ||
+		    !isRunBoundary(pane, old, dmg->col))
+			break;
+
+		n = MIN(dmg->num, cols - dmg->col);
+		if (dmg->type == DAMAGE_INSERT) {
+			/* 右にずらして空白を入れる */
+			char32_t str[n];
+			INIT(str, L' ');
+			insertU32s(old, index, str, NONE, deffg, defbg, n);
+			copyPixmap(pane, x, pane->ypad + ch * dmg->first,
+					cw * (cols - dmg->col - n), ch,
+					x + cw * n, pane->ypad + ch * dmg->first);
+			fillPixmap(pane, pane->term->palette[defbg],
+					x, pane->ypad + ch * dmg->first, cw * n, ch);
+		} else {
+			/* 削除する範囲の終わりも文字やランの境界でなければいけない
+			 * (書いていない画面外の文字が入ってくる場合も再現しない) */
+			getCharCnt(old->str, dmg->col + n, &index, &col, &width);
+			if (col != dmg->col + n || cols < u32swidth(old->str) ||
+			    !isRunBoundary(pane, old, dmg->col + n))
+				break;
+			eraseInLine(old, dmg->col, n);
+			copyPixmap(pane, x + cw * n, pane->ypad + ch * dmg->first,
+					cw * (cols - dmg->col - n), ch,
+					x, pane->ypad + ch * dmg->first);
+			fillPixmap(pane, old->fill < PALETTE_SIZE ?
+					pane->term->palette[old->fill] : old->fill,
+					pane->xpad + cw * (cols - n), pane->ypad + ch * dmg->first,
+					cw * n, ch);
+		}
+		break;
+	}
+}
+
+void
+copyPixmap(Pane *pane, int sx, int sy, int w, int h, int dx, int dy)
+{
+	if (w <= 0 || h <= 0)
+		return;
+	if (pane->raster)
+		copyRaster(pane->raster, pane->raster, sx, sy, w, h, dx, dy);
+	else
+		XCopyArea(pane->dinfo->disp, pane->pixmap, pane->pixmap, pane->gc, sx, sy, w, h, dx, dy);
+	addDamage(pane, dx, dy, w, h);
+}
+
+void
+fillPixmap(Pane *pane, Color color, int x, int y, int w, int h)
+{
+	if (w <= 0 || h <= 0)
+		return;
+	if (pane->raster) {
+		fillRaster(pane->raster, color, x, y, w, h);
+	} else {
+		XSetForeground(pane->dinfo->disp, pane->gc, color);
+		XFillRectangle(pane->dinfo->disp, pane->pixmap, pane->gc, x, y, w, h);
+	}
+	addDamage(pane, x, y, w, h);
+}
+
+/* drawCursorの図形をすぐに書き込み先に塗る */
+void
+fillCanvas(Pane *pane, Color color, int x, int y, int w, int h)
+{
+	if (w <= 0 || h <= 0)
+		return;
+	if (pane->canvas_raster) {
+		fillRaster(pane->canvas_raster, color, x, y, w, h);
+	} else {
+		XSetForeground(pane->dinfo->disp, pane->gc, color);
+		XFillRectangle(pane->dinfo->disp, pane->canvas, pane->gc, x, y, w, h);
+	}
+}
+
+/* drawLineとdrawCursorの書き込み先をPixmapかOverlayに切り替える */
+void
+setCanvas(Pane *pane, bool overlay)
+{
+	pane->canvas = overlay ? pane->overlay : pane->pixmap;
+	pane->canvas_draw = overlay ? pane->odraw : pane->draw;
+	pane->canvas_raster = overlay ? pane->oraster : pane->raster;
+	pane->canvas_y = overlay ? pane->over_y : 0;
+}
+
+/* ウィンドウに写す範囲に加える */
+void
+addDamage(Pane *pane, int x, int y, int w, int h)
+{
+	XRectangle rect;
+
+	w += MIN(x, 0);
+	h += MIN(y, 0);
+	if (w <= 0 || h <= 0)
+		return;
+	rect = (XRectangle){ MAX(x, 0), MAX(y, 0), w, h };
+	XUnionRectWithRegion(&rect, pane->damage, pane->damage);
+}
+
+/*
+ * 前回書いた行がcolorsのどれかの色を使っているか
+ *
+ * 行で使っている色はRowRunsに覚えておき、行のverが変わったときだけ集め直す。
+ * 太字で明るくなる色も使っていることにする。
+ */
+bool
+usesColors(Pane *pane, int row, const uint64_t *colors)
+{
+	RowRuns *rr = &ROW_RUNS(pane, row);
+	const Line *old = OLD_LINE(pane, row);
+	int i;
+
+#define USE(c) if ((c) < PALETTE_SIZE) rr->colors[(c) / 64] |= (uint64_t)1 << (c) % 64
+	if (rr->colors_ver != old->ver) {
+		memset(rr->colors, 0, sizeof(rr->colors));
+		USE(old->fill);
+		for (i = 0; old->str[i]; i++) {
+			USE(old->fg[i]);
+			USE(old->bg[i]);
+			if (old->attr[i] & BOLD) {
+				USE(old->fg[i] + (old->fg[i] < 8 ? 8 : 0));
+				USE(old->bg[i] + (old->bg[i] < 8 ? 8 : 0));
+			}
+		}
+		rr->colors_ver = old->ver;
+	}
+#undef USE
+
+	for (i = 0; i < PALETTE_WORDS; i++)
+		if (rr->colors[i] & colors[i])
+			return true;
+	return false;
+}
+
+unsigned int
+hashRun(const Line *line, int index, int len)
+{
+	unsigned int hash = 2166136261u;
+	int i;
+
+	/* FNV-1a */
+	for (i = index; i < index + len; i++) {
+		hash = (hash ^ line->str [i]) * 16777619u;
+		hash = (hash ^ line->attr[i]) * 16777619u;
+		hash = (hash ^ line->fg  [i]) * 16777619u;
+		hash = (hash ^ line->bg  [i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * 前回書いた行のRunをハッシュ表に並べる
+ *
+ * Runの並びは行ごとに覚えておき、内容が変わった行だけ作り直す。
+ * 表は1フレームに1回、最初に探すときに作る。
+ */
+void
+buildRunTable(Pane *pane)
+{
+	const int rows = pane->term->sb->rows, cols = pane->term->sb->cols + 2;
+	RowRuns *rr;
+	Run *run;
+	Line *old;
+	int r, i, next, over, col, width, size, total = 0;
+
+	/* 内容が変わった行のRunを作り直す (書いた幅に収まるものだけ) */
+	for (r = -1; r < rows + 2; r++) {
+		rr = &ROW_RUNS(pane, r);
+		old = OLD_LINE(pane, r);
+		if (rr->ver != old->ver) {
+			rr->len = 0;
+			for (i = 0, col = 0; old->str[i]; i = next, col += width) {
+				next = findRunEnd(pane, old, i, &over);
+				width = u32snwidth(&old->str[i], next - i);
+				if (cols < col + width)
+					break;
+				if (rr->size <= rr->len) {
+					rr->size = MAX(rr->size * 2, 8);
+					rr->runs = xrealloc(rr->runs, rr->size * sizeof(Run));
+				}
+				rr->runs[rr->len++] = (Run){ hashRun(old, i, next - i),
+					0, col, i, next - i };
+			}
+			rr->ver = old->ver;
+		}
+		total += rr->len;
+	}
+
+	/* 表の大きさは2の冪にする */
+	for (size = 64; size < total * 2; size <<= 1);
+	if (pane->table_size != size) {
+		pane->table_size = size;
+		pane->table = xrealloc(pane->table, size * sizeof(Run *));
+	}
+	memset(pane->table, 0, size * sizeof(Run *));
+
+	/* 行はスクロールで入れ替わるので位置はここで入れる */
+	for (r = -1; r < rows + 2; r++) {
+		rr = &ROW_RUNS(pane, r);
+		for (i = 0; i < rr->len; i++) {
+			run = &rr->runs[i];
+			run->row = r;
+			run->next = pane->table[run->hash & (size - 1)];
+			pane->table[run->hash & (size - 1)] = run;
+		}
+	}
+
+	pane->table_valid = true;
+}
+
+/*
+ * lineのindexからlen文字と同じ内容を前回書いた行から探す
+ *
+ * 同じ位置にあればそれを、なければコピーできる画面内の行のものを返す。
+ * Pixmapの上でコピーするので、今回既に書き換えた行はコピー元にしない。
+ */
+Run *
+findRun(Pane *pane, const Line *line, int index, int len, int row, int col)
+{
+	const unsigned int hash = hashRun(line, index, len);
+	Run *run, *found = NULL;
+	Line *old;
+
+	if (!pane->table_valid)
+		buildRunTable(pane);
+
+#define CMP(A,T) !memcmp(&line->A[index], &old->A[run->index], len * sizeof(T))
+	for (run = pane->table[hash & (pane->table_size - 1)]; run; run = run->next) {
+		old = OLD_LINE(pane, run->row);
+		if (run->hash != hash || run->len != len ||
+		    !(CMP(str, char32_t) && CMP(attr, int) && CMP(fg, Color) && CMP(bg, Color)))
+			continue;
+		if (run->row == row && run->col == col)
+			return run;
+		if (!found && BETWEEN(run->row, 0, pane->term->sb->rows) &&
+		    !ROW_RUNS(pane, run->row).drawn)
+			found = run;
+	}
+#undef CMP
+
+	return found;
 }
 
 void
 freePixmap(Pane *pane)
 {
+	if (pane->raster) {
+		closeRaster(pane->raster);
+		closeRaster(pane->oraster);
+		closeRaster(pane->braster);
+		pane->raster = pane->oraster = pane->braster = NULL;
+		return;
+	}
+	if (pane->blink)
+		XFreePixmap(pane->dinfo->disp, pane->blink);
+	pane->blink = None;
 	XftDrawDestroy(pane->draw);
+	XftDrawDestroy(pane->odraw);
 	XFreeGC(pane->dinfo->disp, pane->gc);
 	XFreePixmap(pane->dinfo->disp, pane->pixmap);
-	XFreePixmap(pane->dinfo->disp, pane->pixbuf);
+	XFreePixmap(pane->dinfo->disp, pane->overlay);
 }
 
 void
@@ -475,40 +1485,73 @@ createPixmap(Pane *pane, int w, int h)
 {
 	const DispInfo *i = pane->dinfo;
 
+	pane->pix_w = w;
+	pane->pix_h = h;
+	pane->over_w = 0;
+
+	/* クライアント側で描く (MIT-SHMが使えなければサーバー側で描く) */
+	if (pane->shm) {
+		pane->raster = openRaster(i->disp, i->visual, pane->depth, w, h);
+		if (pane->raster)
+			pane->oraster = openRaster(i->disp, i->visual, pane->depth,
+					w, pane->xfont->ch);
+		if (pane->oraster)
+			return;
+		closeRaster(pane->raster);
+		pane->raster = NULL;
+		pane->shm = false;
+		fprintf(stderr, "MIT-SHM is not available.\n");
+	}
+
 	pane->pixmap = XCreatePixmap(i->disp, i->root, w, h, pane->depth);
-	pane->pixbuf = XCreatePixmap(i->disp, i->root, w, h, pane->depth);
+	pane->overlay = XCreatePixmap(i->disp, i->root, w, pane->xfont->ch, pane->depth);
 	pane->gc = XCreateGC(i->disp, pane->pixmap, 0, NULL);
 	XSetGraphicsExposures(i->disp, pane->gc, false);
 	pane->draw = XftDrawCreate(i->disp, pane->pixmap, i->visual, i->cmap);
+	pane->odraw = XftDrawCreate(i->disp, pane->overlay, i->visual, i->cmap);
 }
 
 void
-clearPixmap(Pane *pane, nsec now)
+clearPixmap(Pane *pane)
 {
-	Line **plines;
-	int i;
+	const int len = pane->term->sb->rows + 3;
+	int i, oldlen = 0;
 
 	/* Pixmapを背景色でクリア */
-	XSetForeground(pane->dinfo->disp, pane->gc, BELLCOLOR(pane->term->palette[defbg]));
-	XFillRectangle(pane->dinfo->disp, pane->pixmap, pane->gc, 0, 0, pane->width, pane->height);
-	XSetForeground(pane->dinfo->disp, pane->gc, BELLCOLOR(pane->term->palette[defbg]));
-	XFillRectangle(pane->dinfo->disp, pane->pixbuf, pane->gc, 0, 0, pane->width, pane->height);
-
-	/* Lineバッファをクリア */
-	if (pane->new_lines)
-		for (plines = pane->new_lines; *plines; plines++)
-			freeLine(*plines);
-	if (pane->old_lines)
-		for (plines = pane->old_lines; *plines; plines++)
-			freeLine(*plines);
-	pane->new_lines = xrealloc(pane->new_lines, (pane->term->sb->rows + 4) * sizeof(Line *));
-	pane->new_lines[pane->term->sb->rows + 3] = NULL;
-	pane->old_lines = xrealloc(pane->old_lines, (pane->term->sb->rows + 4) * sizeof(Line *));
-	pane->old_lines[pane->term->sb->rows + 3] = NULL;
-	for (i = 0; i < pane->term->sb->rows + 3; i++) {
-		pane->new_lines[i] = allocLine();
-		pane->old_lines[i] = allocLine();
+	fillPixmap(pane, pane->term->palette[defbg], 0, 0, pane->pix_w, pane->pix_h);
+
+	/* Lineバッファをクリア (行数が変わった分だけ確保・解放する) */
+	while (pane->new_lines && pane->new_lines[oldlen])
+		oldlen++;
+	for (i = len; i < oldlen; i++) {
+		freeLine(pane->new_lines[i]);
+		freeLine(pane->old_lines[i]);
+	}
+	pane->new_lines = xrealloc(pane->new_lines, (len + 1) * sizeof(Line *));
+	pane->old_lines = xrealloc(pane->old_lines, (len + 1) * sizeof(Line *));
+	for (i = oldlen; i < len; i++) {
+		pane->new_lines[i] = allocLine(pane->term->pool);
+		pane->old_lines[i] = allocLine(pane->term->pool);
+	}
+	for (i = 0; i < len; i++) {
+		PUT_NUL(pane->new_lines[i], 0);
+		PUT_NUL(pane->old_lines[i], 0);
 	}
+	pane->new_lines[len] = pane->old_lines[len] = NULL;
+
+	/* 書いた行のバージョンを忘れる */
+	pane->vers = xrealloc(pane->vers, len * sizeof(uint64_t));
+	memset(pane->vers, 0, len * sizeof(uint64_t));
+
+	/* 行ごとのRunの並びも作り直させる */
+	for (i = len; i < oldlen; i++)
+		free(pane->runs[i].runs);
+	pane->runs = xrealloc(pane->runs, len * sizeof(RowRuns));
+	for (i = oldlen; i < len; i++)
+		pane->runs[i] = (RowRuns){ 0 };
+	for (i = 0; i < len; i++)
+		pane->runs[i].ver = 0;
+	pane->table_valid = false;
 
 	pane->redraw_flag = true;
 }
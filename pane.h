@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include <time.h>
+#include <X11/Xutil.h>
 
 #include "font.h"
 #include "term.h"
@@ -22,29 +23,51 @@ enum timer_names { BLINK_TIMER, RAPID_TIMER, CARET_TIMER, TIMER_NUM };
 typedef struct Pane {
 	DispInfo *dinfo;
 	XFont *xfont;
-	Pixmap pixmap, pixbuf;
+	Pixmap pixmap, overlay;
 	unsigned int depth;
 	GC gc;
-	XftDraw *draw;
+	XftDraw *draw, *odraw;
+	Drawable canvas;
+	XftDraw *canvas_draw;
+	struct Raster *raster, *oraster, *canvas_raster;
+	int canvas_y;
 	int width, height, xpad, ypad;
-	bool focus, redraw_flag;
+	int pix_w, pix_h;
+	bool shm;               /* クライアント側で描いてMIT-SHMで送る */
+	bool focus, redraw_flag, resize_flag;
+	nsec resize_time;
 	nsec time_b;
 	nsec caret_time, bell_time;
 	bool timer_active[TIMER_NUM];
 	Term *term;
 	Line **new_lines, **old_lines;
-	Selection sel;
+	uint64_t *vers;
+	struct RowRuns *runs;
+	struct Run **table;
+	int table_size;
+	bool table_valid;
+	struct Batch *batch;
+	Pixmap blink;                   /* 点滅する文字を表示した状態で写しておく */
+	struct Raster *braster;
+	struct Blink *blinks;
+	int blinks_len, blinks_size;
+	Selection sel, prevsel;
 	struct ScrBuf *prevbuf;
-	int scr, prevfst;
-	int clear_x, clear_y, clear_w, clear_h;
+	int scr, prevscr;
+	int64_t prevfst;
+	int over_x, over_y, over_w, over_h;
+	Region damage;
 	int bell_cnt, palette_cnt;
+	Color *palette_b;               /* 前回書いたときのパレット */
 } Pane;
 
-Pane *createPane(DispInfo *, XFont *, int, int, float, int, char *const []);
+Pane *createPane(DispInfo *, XFont *, int, int, float, int, bool, bool, char *const []);
 void destroyPane(Pane *);
-void setPaneSize(Pane *, int, int);
+void setPaneSize(Pane *, int, int, nsec);
 void mouseEvent(Pane *, XEvent *);
+bool shmCompletionEvent(Pane *, XEvent *);
 void scrollPane(Pane *, int);
 void selectPane(Pane *, int, int, bool, bool);
 nsec getNextTime(Pane *, nsec);
 int drawPane(Pane *, nsec, Line *, int);
+void presentPane(Pane *, Drawable, GC, Region);
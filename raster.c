@@ -0,0 +1,655 @@
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_SYNTHESIS_H
+#include FT_LCD_FILTER_H
+
+#include "raster.h"
+#include "util.h"
+
+/*
+ * Raster
+ *
+ * クライアント側の画像に描いてMIT-SHMでXサーバーに送る
+ *
+ * 背景とグリフはpushRaster*で溜めておき、flushRasterで画像を横長の帯に
+ * 分けてスレッドで並行に書く。グリフはFreeTypeで描いたものを覚えておく。
+ */
+
+#define BAND_HEIGHT     (16)    /* 1回に受け持つ帯の高さ */
+#define THREAD_MAX      (8)     /* 描画スレッドの最大数 */
+#define SERIAL_MAX      (64)    /* これより少なければスレッドを使わない */
+#define GLYPH_HASH(f, i) ((unsigned int)((uintptr_t)(f) >> 4) * 2654435761u ^ (i) * 40503u)
+
+/* FreeTypeで描いたグリフ */
+typedef struct GlyphBits {
+	XftFont *font;
+	FT_UInt index;
+	int left, top;          /* 原点からの位置 */
+	int w, h;
+	bool lcd;               /* サブピクセルで描いたか */
+	unsigned char *alpha;   /* w * h個の不透明度 (サブピクセルならRGBの3個ずつ) */
+	struct GlyphBits *next; /* ハッシュ表の同じ枠の次 */
+} GlyphBits;
+
+/* 溜めておく描画 (glyphがNULLなら塗りつぶし) */
+typedef struct Cmd {
+	uint32_t color;
+	int x1, y1, x2, y2;     /* 書き換える範囲 */
+	const GlyphBits *glyph;
+	int x, y;               /* グリフの原点 */
+} Cmd;
+
+struct Raster {
+	Display *disp;
+	XImage *image;
+	XShmSegmentInfo shminfo;
+	uint32_t *px;
+	int w, h, stride;
+	int pending;            /* 送ってまだShmCompletionが届いていない画像の数 */
+	Cmd *cmds;
+	int cmds_len, cmds_size;
+	struct Band {
+		int *cmds;      /* 帯にかかるCmdの番号 */
+		int len, size;
+	} *bands;
+	int bands_len;
+};
+
+/* 描画スレッド (最初のRasterを開いたときに作り、終了まで残す) */
+static struct Pool {
+	pthread_t threads[THREAD_MAX];
+	int len;
+	bool started;
+	pthread_mutex_t mutex;
+	pthread_cond_t start, done;
+	unsigned long gen;      /* 仕事を渡すたびに増やす */
+	Raster *raster;         /* 書いているRaster */
+	int next;               /* 次に書く帯 */
+	int busy;               /* 仕事中のスレッドの数 */
+} pool = { .mutex = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+/* グリフのキャッシュ (描画スレッドは読むだけ) */
+static GlyphBits **glyph_table;
+static int glyph_table_size, glyphs_len;
+
+static bool shm_error;
+
+static void startPool(void);
+static void *poolMain(void *);
+static void drawBands(void);
+static void drawBand(Raster *, int);
+static void pushCmd(Raster *, Cmd);
+static void waitRaster(Raster *);
+static Bool isCompletion(Display *, XEvent *, XPointer);
+static GlyphBits *getGlyph(XftFont *, FT_UInt);
+static GlyphBits *loadGlyph(XftFont *, FT_UInt);
+static FT_Int32 getLoadFlags(XftFont *, FT_Face, FT_Render_Mode *, int *);
+static uint32_t blendPixel(uint32_t, uint32_t, unsigned int);
+static uint32_t blendSubpixel(uint32_t, uint32_t, const unsigned char *);
+static int shmErrorHandler(Display *, XErrorEvent *);
+
+Raster *
+openRaster(Display *disp, Visual *visual, int depth, int w, int h)
+{
+	const int native = *(char *)&(int){ 1 } ? LSBFirst : MSBFirst;
+	XErrorHandler handler;
+	Raster *raster;
+
+	if (!XShmQueryExtension(disp))
+		return NULL;
+
+	raster = xmalloc(sizeof(Raster));
+	*raster = (Raster){ .disp = disp, .w = w, .h = h };
+	raster->shminfo.shmid = -1;
+	raster->shminfo.shmaddr = (char *)-1;
+
+	/* 1画素32bitで、CPUと同じバイト順の画像しか扱わない */
+	raster->image = XShmCreateImage(disp, visual, depth, ZPixmap, NULL,
+			&raster->shminfo, w, h);
+	if (!raster->image || raster->image->bits_per_pixel != 32 ||
+	    raster->image->byte_order != native)
+		goto fail;
+
+	raster->shminfo.shmid = shmget(IPC_PRIVATE,
+			raster->image->bytes_per_line * h, IPC_CREAT | 0600);
+	if (raster->shminfo.shmid < 0)
+		goto fail;
+	raster->shminfo.shmaddr = shmat(raster->shminfo.shmid, NULL, 0);
+	if (raster->shminfo.shmaddr == (char *)-1)
+		goto fail;
+	raster->image->data = raster->shminfo.shmaddr;
+	raster->shminfo.readOnly = False;
+
+	/* 別のマシンのサーバーではAttachがエラーになるので同期して確かめる */
+	XSync(disp, False);
+	shm_error = false;
+	handler = XSetErrorHandler(shmErrorHandler);
+	XShmAttach(disp, &raster->shminfo);
+	XSync(disp, False);
+	XSetErrorHandler(handler);
+	if (shm_error)
+		goto fail;
+
+	/* 両方がアタッチしたら消しておく (終了時に残らないように) */
+	shmctl(raster->shminfo.shmid, IPC_RMID, NULL);
+
+	raster->px = (uint32_t *)raster->image->data;
+	raster->stride = raster->image->bytes_per_line / 4;
+	raster->bands_len = (h + BAND_HEIGHT - 1) / BAND_HEIGHT;
+	raster->bands = xmalloc(raster->bands_len * sizeof(struct Band));
+	memset(raster->bands, 0, raster->bands_len * sizeof(struct Band));
+	startPool();
+
+	return raster;
+
+fail:
+	if (raster->shminfo.shmaddr != (char *)-1)
+		shmdt(raster->shminfo.shmaddr);
+	if (0 <= raster->shminfo.shmid)
+		shmctl(raster->shminfo.shmid, IPC_RMID, NULL);
+	if (raster->image) {
+		raster->image->data = NULL;
+		XDestroyImage(raster->image);
+	}
+	free(raster);
+	return NULL;
+}
+
+void
+closeRaster(Raster *raster)
+{
+	int i;
+
+	if (raster == NULL)
+		return;
+
+	XShmDetach(raster->disp, &raster->shminfo);
+	XSync(raster->disp, False);
+	shmdt(raster->shminfo.shmaddr);
+	raster->image->data = NULL;
+	XDestroyImage(raster->image);
+
+	for (i = 0; i < raster->bands_len; i++)
+		free(raster->bands[i].cmds);
+	free(raster->bands);
+	free(raster->cmds);
+	free(raster);
+}
+
+/* すぐに塗る */
+void
+fillRaster(Raster *raster, uint32_t color, int x, int y, int w, int h)
+{
+	const int x1 = MAX(x, 0), x2 = MIN(x + w, raster->w);
+	const int y1 = MAX(y, 0), y2 = MIN(y + h, raster->h);
+	uint32_t *p;
+	int i, j;
+
+	waitRaster(raster);
+	for (j = y1; j < y2; j++)
+		for (p = &raster->px[j * raster->stride], i = x1; i < x2; i++)
+			p[i] = color;
+}
+
+/* すぐにsrcからdstに写す (同じRasterで重なっていてもいい) */
+void
+copyRaster(Raster *dst, Raster *src, int sx, int sy, int w, int h, int dx, int dy)
+{
+	int j;
+
+	/* はみ出す分を削る */
+	if (sx < 0) { w += sx; dx -= sx; sx = 0; }
+	if (sy < 0) { h += sy; dy -= sy; sy = 0; }
+	if (dx < 0) { w += dx; sx -= dx; dx = 0; }
+	if (dy < 0) { h += dy; sy -= dy; dy = 0; }
+	w = MIN(w, MIN(src->w - sx, dst->w - dx));
+	h = MIN(h, MIN(src->h - sy, dst->h - dy));
+	if (w <= 0 || h <= 0)
+		return;
+
+	/* 下にずらすときは下の行から写す */
+	waitRaster(dst);
+	if (src == dst && sy < dy) {
+		for (j = h - 1; 0 <= j; j--)
+			memmove(&dst->px[(dy + j) * dst->stride + dx],
+					&src->px[(sy + j) * src->stride + sx], w * 4);
+	} else {
+		for (j = 0; j < h; j++)
+			memmove(&dst->px[(dy + j) * dst->stride + dx],
+					&src->px[(sy + j) * src->stride + sx], w * 4);
+	}
+}
+
+/* 塗りつぶしを溜める */
+void
+pushRasterFill(Raster *raster, uint32_t color, int x, int y, int w, int h)
+{
+	pushCmd(raster, (Cmd){ color, x, y, x + w, y + h, NULL });
+}
+
+/* グリフを溜める (clipの外には書かない) */
+void
+pushRasterGlyphs(Raster *raster, uint32_t color, const XftGlyphFontSpec *specs, int len, XRectangle clip)
+{
+	const GlyphBits *g;
+	int i;
+
+	color |= 0xff000000;
+	for (i = 0; i < len; i++) {
+		g = getGlyph(specs[i].font, specs[i].glyph);
+		if (g->w == 0 || g->h == 0)
+			continue;
+		pushCmd(raster, (Cmd){ color,
+			MAX(clip.x, specs[i].x + g->left),
+			MAX(clip.y, specs[i].y - g->top),
+			MIN(clip.x + clip.width,  specs[i].x + g->left + g->w),
+			MIN(clip.y + clip.height, specs[i].y - g->top  + g->h),
+			g, specs[i].x, specs[i].y });
+	}
+}
+
+/* 溜めた描画を帯ごとにスレッドで書く */
+void
+flushRaster(Raster *raster)
+{
+	int i;
+
+	if (raster->cmds_len == 0)
+		return;
+	waitRaster(raster);
+
+	if (raster->cmds_len < SERIAL_MAX || pool.len == 0) {
+		for (i = 0; i < raster->bands_len; i++)
+			drawBand(raster, i);
+	} else {
+		pthread_mutex_lock(&pool.mutex);
+		pool.raster = raster;
+		pool.next = 0;
+		pool.busy = pool.len;
+		pool.gen++;
+		pthread_cond_broadcast(&pool.start);
+		drawBands();
+		while (0 < pool.busy)
+			pthread_cond_wait(&pool.done, &pool.mutex);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+
+	raster->cmds_len = 0;
+	for (i = 0; i < raster->bands_len; i++)
+		raster->bands[i].len = 0;
+}
+
+/* 画像の一部をdに送る (gcのクリップが効く) */
+void
+putRaster(Raster *raster, Drawable d, GC gc, int sx, int sy, int w, int h, int dx, int dy)
+{
+	/* XCopyAreaと違って画像からはみ出すとエラーになる */
+	if (sx < 0) { w += sx; dx -= sx; sx = 0; }
+	if (sy < 0) { h += sy; dy -= sy; sy = 0; }
+	w = MIN(w, raster->w - sx);
+	h = MIN(h, raster->h - sy);
+	if (w <= 0 || h <= 0)
+		return;
+	XShmPutImage(raster->disp, d, gc, raster->image, sx, sy, dx, dy, w, h, True);
+	raster->pending++;
+}
+
+/* eventがこのRasterから送った画像のShmCompletionなら数えてtrueを返す */
+bool
+handleRasterEvent(Raster *raster, XEvent *event)
+{
+	if (raster == NULL || !isCompletion(raster->disp, event, (XPointer)raster))
+		return false;
+	raster->pending = MAX(raster->pending - 1, 0);
+	return true;
+}
+
+void
+startPool(void)
+{
+	int i, n;
+
+	if (pool.started)
+		return;
+	pool.started = true;
+
+	/* 描画を呼んだスレッドも帯を書くので1つ少なく作る */
+	n = CLIP((int)sysconf(_SC_NPROCESSORS_ONLN) - 1, 0, THREAD_MAX);
+	for (i = 0; i < n; i++)
+		if (pthread_create(&pool.threads[pool.len], NULL, poolMain, NULL) == 0)
+			pool.len++;
+}
+
+void *
+poolMain(void *arg)
+{
+	unsigned long gen = 0;
+
+	pthread_mutex_lock(&pool.mutex);
+	while (1) {
+		while (pool.gen == gen)
+			pthread_cond_wait(&pool.start, &pool.mutex);
+		gen = pool.gen;
+		drawBands();
+		if (--pool.busy == 0)
+			pthread_cond_signal(&pool.done);
+	}
+
+	return NULL;
+}
+
+/* 残っている帯を1つずつ取って書く (pool.mutexを持って呼ぶ) */
+void
+drawBands(void)
+{
+	Raster *raster = pool.raster;
+	int band;
+
+	while (pool.next < raster->bands_len) {
+		band = pool.next++;
+		pthread_mutex_unlock(&pool.mutex);
+		drawBand(raster, band);
+		pthread_mutex_lock(&pool.mutex);
+	}
+}
+
+/* 1つの帯にかかる描画を溜めた順に書く */
+void
+drawBand(Raster *raster, int band)
+{
+	const struct Band *b = &raster->bands[band];
+	const int top = band * BAND_HEIGHT, bottom = MIN(top + BAND_HEIGHT, raster->h);
+	const unsigned char *a;
+	const Cmd *cmd;
+	uint32_t *p;
+	int i, x, y, x1, x2, y1, y2, gx, gy;
+
+	for (i = 0; i < b->len; i++) {
+		cmd = &raster->cmds[b->cmds[i]];
+		x1 = cmd->x1;
+		x2 = cmd->x2;
+		y1 = MAX(cmd->y1, top);
+		y2 = MIN(cmd->y2, bottom);
+
+		if (!cmd->glyph) {
+			for (y = y1; y < y2; y++)
+				for (p = &raster->px[y * raster->stride], x = x1; x < x2; x++)
+					p[x] = cmd->color;
+			continue;
+		}
+
+		gx = cmd->x + cmd->glyph->left;
+		gy = cmd->y - cmd->glyph->top;
+		for (y = y1; y < y2; y++) {
+			p = &raster->px[y * raster->stride];
+			if (cmd->glyph->lcd) {
+				a = &cmd->glyph->alpha[(y - gy) * cmd->glyph->w * 3];
+				for (x = x1; x < x2; x++)
+					if (a[(x - gx) * 3] | a[(x - gx) * 3 + 1] | a[(x - gx) * 3 + 2])
+						p[x] = blendSubpixel(p[x], cmd->color, &a[(x - gx) * 3]);
+				continue;
+			}
+			a = &cmd->glyph->alpha[(y - gy) * cmd->glyph->w];
+			for (x = x1; x < x2; x++)
+				if (a[x - gx] == 0xff)
+					p[x] = cmd->color;
+				else if (a[x - gx])
+					p[x] = blendPixel(p[x], cmd->color, a[x - gx]);
+		}
+	}
+}
+
+/* 画像に収まる範囲に切って、かかる帯に番号を入れる */
+void
+pushCmd(Raster *raster, Cmd cmd)
+{
+	struct Band *b;
+	int i;
+
+	cmd.x1 = MAX(cmd.x1, 0);
+	cmd.y1 = MAX(cmd.y1, 0);
+	cmd.x2 = MIN(cmd.x2, raster->w);
+	cmd.y2 = MIN(cmd.y2, raster->h);
+	if (cmd.x2 <= cmd.x1 || cmd.y2 <= cmd.y1)
+		return;
+
+	if (raster->cmds_size <= raster->cmds_len) {
+		raster->cmds_size = MAX(raster->cmds_size * 2, 256);
+		raster->cmds = xrealloc(raster->cmds, raster->cmds_size * sizeof(Cmd));
+	}
+	raster->cmds[raster->cmds_len] = cmd;
+
+	for (i = cmd.y1 / BAND_HEIGHT; i <= (cmd.y2 - 1) / BAND_HEIGHT; i++) {
+		b = &raster->bands[i];
+		if (b->size <= b->len) {
+			b->size = MAX(b->size * 2, 64);
+			b->cmds = xrealloc(b->cmds, b->size * sizeof(int));
+		}
+		b->cmds[b->len++] = raster->cmds_len;
+	}
+	raster->cmds_len++;
+}
+
+/*
+ * 前に送った画像をサーバーが読み終わるまで待つ
+ *
+ * 普段は次のフレームまでにShmCompletionが届いてhandleRasterEventで数え終わるので、
+ * 届く前に書き始めるときだけ、他のイベントを残したまま待つ。
+ */
+void
+waitRaster(Raster *raster)
+{
+	XEvent event;
+
+	for (; 0 < raster->pending; raster->pending--)
+		XIfEvent(raster->disp, &event, isCompletion, (XPointer)raster);
+}
+
+Bool
+isCompletion(Display *disp, XEvent *event, XPointer arg)
+{
+	const Raster *raster = (Raster *)arg;
+
+	return event->type == XShmGetEventBase(disp) + ShmCompletion &&
+		((XShmCompletionEvent *)event)->shmseg == raster->shminfo.shmseg;
+}
+
+GlyphBits *
+getGlyph(XftFont *font, FT_UInt index)
+{
+	const unsigned int hash = GLYPH_HASH(font, index);
+	GlyphBits *g, *next, **table;
+	int i, size;
+
+	if (glyph_table_size) {
+		for (g = glyph_table[hash & (glyph_table_size - 1)]; g; g = g->next)
+			if (g->font == font && g->index == index)
+				return g;
+	}
+
+	/* 表が埋まってきたら広げる */
+	if (glyph_table_size <= glyphs_len * 2) {
+		size = MAX(glyph_table_size * 2, 1024);
+		table = xmalloc(size * sizeof(GlyphBits *));
+		memset(table, 0, size * sizeof(GlyphBits *));
+		for (i = 0; i < glyph_table_size; i++) {
+			for (g = glyph_table[i]; g; g = next) {
+				next = g->next;
+				g->next = table[GLYPH_HASH(g->font, g->index) & (size - 1)];
+				table[GLYPH_HASH(g->font, g->index) & (size - 1)] = g;
+			}
+		}
+		free(glyph_table);
+		glyph_table = table;
+		glyph_table_size = size;
+	}
+
+	g = loadGlyph(font, index);
+	g->next = glyph_table[hash & (glyph_table_size - 1)];
+	glyph_table[hash & (glyph_table_size - 1)] = g;
+	glyphs_len++;
+
+	return g;
+}
+
+/* FreeTypeでグリフを描いて不透明度だけ取っておく */
+GlyphBits *
+loadGlyph(XftFont *font, FT_UInt index)
+{
+	GlyphBits *g = xmalloc(sizeof(GlyphBits));
+	FcBool embolden = FcFalse;
+	const unsigned char *row;
+	FT_Render_Mode mode;
+	FT_Int32 flags;
+	FT_Bitmap *bm;
+	FT_Face face;
+	int x, y, c, bgr;
+
+	*g = (GlyphBits){ .font = font, .index = index };
+	if (!(face = XftLockFace(font)))
+		return g;
+
+	/* 太字のないフォントはXftと同じように太らせる */
+	FcPatternGetBool(font->pattern, FC_EMBOLDEN, 0, &embolden);
+	flags = getLoadFlags(font, face, &mode, &bgr);
+	if (FT_Load_Glyph(face, index, flags) != 0) {
+		XftUnlockFace(font);
+		return g;
+	}
+	if (embolden)
+		FT_GlyphSlot_Embolden(face->glyph);
+	if (FT_Render_Glyph(face->glyph, mode) == 0) {
+		bm = &face->glyph->bitmap;
+		g->left = face->glyph->bitmap_left;
+		g->top = face->glyph->bitmap_top;
+		g->lcd = bm->pixel_mode == FT_PIXEL_MODE_LCD || bm->pixel_mode == FT_PIXEL_MODE_LCD_V;
+		g->w = bm->width / (bm->pixel_mode == FT_PIXEL_MODE_LCD ? 3 : 1);
+		g->h = bm->rows / (bm->pixel_mode == FT_PIXEL_MODE_LCD_V ? 3 : 1);
+		g->alpha = xmalloc(MAX(g->w * g->h * (g->lcd ? 3 : 1), 1));
+		for (y = 0; y < g->h; y++) {
+			row = bm->buffer + (bm->pitch < 0 ?
+					(bm->rows - 1 - y) * -bm->pitch : y * bm->pitch);
+			for (x = 0; x < g->w; x++) {
+				if (bm->pixel_mode == FT_PIXEL_MODE_MONO)
+					g->alpha[y * g->w + x] = (row[x >> 3] >> (7 - (x & 7)) & 1) * 0xff;
+				else if (!g->lcd)
+					g->alpha[y * g->w + x] = row[x];
+				/* サブピクセルはRGBの順に並べ直す (縦並びは3行で1画素) */
+				else for (c = 0; c < 3; c++)
+					g->alpha[(y * g->w + x) * 3 + (bgr ? 2 - c : c)] =
+						bm->pixel_mode == FT_PIXEL_MODE_LCD ? row[x * 3 + c] :
+						bm->buffer[(y * 3 + c) * bm->pitch + x];
+			}
+		}
+	}
+	XftUnlockFace(font);
+
+	return g;
+}
+
+/*
+ * フォントのパターンからXftと同じグリフの読み込み方と描き方を決める
+ *
+ * アンチエイリアス・ヒンティング・オートヒント・サブピクセルの設定を見る。
+ * bgrにはサブピクセルが逆順かを入れる。
+ */
+FT_Int32
+getLoadFlags(XftFont *font, FT_Face face, FT_Render_Mode *mode, int *bgr)
+{
+	FcBool antialias = FcTrue, hinting = FcTrue, autohint = FcFalse, bitmap = FcFalse;
+	int hintstyle = FC_HINT_FULL, rgba = FC_RGBA_UNKNOWN, filter = FC_LCD_DEFAULT;
+	FT_Int32 flags = FT_LOAD_DEFAULT;
+
+	FcPatternGetBool(font->pattern, FC_ANTIALIAS, 0, &antialias);
+	FcPatternGetBool(font->pattern, FC_HINTING, 0, &hinting);
+	FcPatternGetBool(font->pattern, FC_AUTOHINT, 0, &autohint);
+	FcPatternGetBool(font->pattern, FC_EMBEDDED_BITMAP, 0, &bitmap);
+	FcPatternGetInteger(font->pattern, FC_HINT_STYLE, 0, &hintstyle);
+	FcPatternGetInteger(font->pattern, FC_RGBA, 0, &rgba);
+	FcPatternGetInteger(font->pattern, FC_LCD_FILTER, 0, &filter);
+
+	/* 描き方 */
+	*bgr = rgba == FC_RGBA_BGR || rgba == FC_RGBA_VBGR;
+	*mode = !antialias ? FT_RENDER_MODE_MONO :
+		rgba == FC_RGBA_RGB  || rgba == FC_RGBA_BGR  ? FT_RENDER_MODE_LCD :
+		rgba == FC_RGBA_VRGB || rgba == FC_RGBA_VBGR ? FT_RENDER_MODE_LCD_V :
+		FT_RENDER_MODE_NORMAL;
+	if (*mode == FT_RENDER_MODE_LCD || *mode == FT_RENDER_MODE_LCD_V)
+		FT_Library_SetLcdFilter(face->glyph->library,
+				filter == FC_LCD_NONE  ? FT_LCD_FILTER_NONE  :
+				filter == FC_LCD_LIGHT ? FT_LCD_FILTER_LIGHT :
+				filter == FC_LCD_LEGACY ? FT_LCD_FILTER_LEGACY : FT_LCD_FILTER_DEFAULT);
+
+	/* 読み込み方 */
+	if (antialias && !bitmap)
+		flags |= FT_LOAD_NO_BITMAP;
+	if (!hinting || hintstyle == FC_HINT_NONE)
+		flags |= FT_LOAD_NO_HINTING;
+	else if (!antialias)
+		flags |= FT_LOAD_TARGET_MONO;
+	else if (hintstyle == FC_HINT_SLIGHT)
+		flags |= FT_LOAD_TARGET_LIGHT;
+	else if (hintstyle == FC_HINT_FULL && *mode == FT_RENDER_MODE_LCD)
+		flags |= FT_LOAD_TARGET_LCD;
+	else if (hintstyle == FC_HINT_FULL && *mode == FT_RENDER_MODE_LCD_V)
+		flags |= FT_LOAD_TARGET_LCD_V;
+	if (autohint)
+		flags |= FT_LOAD_FORCE_AUTOHINT;
+
+	return flags;
+}
+
+/*
+ * dにcolorをaの割合で重ねる (XRenderのOverと同じ)
+ *
+ * 1回の掛け算で2つのチャンネルをまとめて計算し、255での割り算は
+ * (t + 128 + (t >> 8)) >> 8 で代える。
+ */
+uint32_t
+blendPixel(uint32_t d, uint32_t color, unsigned int a)
+{
+	uint32_t rb, ag;
+
+	rb = (color & 0x00ff00ff) * a + (d & 0x00ff00ff) * (0xff - a);
+	ag = (color >> 8 & 0x00ff00ff) * a + (d >> 8 & 0x00ff00ff) * (0xff - a);
+	rb += 0x00800080;
+	ag += 0x00800080;
+	rb = (rb + (rb >> 8 & 0x00ff00ff)) >> 8 & 0x00ff00ff;
+	ag = (ag + (ag >> 8 & 0x00ff00ff)) & 0xff00ff00;
+
+	return rb | ag;
+}
+
+/* dにcolorをRGBごとの割合aで重ねる (不透明度はGの割合で重ねる) */
+uint32_t
+blendSubpixel(uint32_t d, uint32_t color, const unsigned char *a)
+{
+	const unsigned int as[4] = { a[1], a[0], a[1], a[2] };
+	uint32_t out = 0, t;
+	int i, sh;
+
+	for (i = 0; i < 4; i++) {
+		sh = 24 - 8 * i;
+		t = (color >> sh & 0xff) * as[i] + (d >> sh & 0xff) * (0xff - as[i]) + 0x80;
+		out |= ((t + (t >> 8)) >> 8) << sh;
+	}
+
+	return out;
+}
+
+int
+shmErrorHandler(Display *disp, XErrorEvent *event)
+{
+	shm_error = true;
+	return 0;
+}
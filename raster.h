@@ -0,0 +1,16 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+
+typedef struct Raster Raster;
+
+Raster *openRaster(Display *, Visual *, int, int, int);
+void closeRaster(Raster *);
+void fillRaster(Raster *, uint32_t, int, int, int, int);
+void copyRaster(Raster *, Raster *, int, int, int, int, int, int);
+void pushRasterFill(Raster *, uint32_t, int, int, int, int);
+void pushRasterGlyphs(Raster *, uint32_t, const XftGlyphFontSpec *, int, XRectangle);
+void flushRaster(Raster *);
+void putRaster(Raster *, Drawable, GC, int, int, int, int, int, int);
+bool handleRasterEvent(Raster *, XEvent *);
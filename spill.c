@@ -0,0 +1,231 @@
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "line.h"
+#include "spill.h"
+#include "util.h"
+
+/*
+ * Spill
+ *
+ * バッファから溢れた行を一時ファイルに退避する
+ *
+ * 行はSPILL_BLOCK行ずつのブロックにまとめて追記する。
+ * ブロックの先頭には各行の位置を並べたヘッダを置き、読むときは
+ * ブロック単位でmmapする。
+ */
+
+#define SPILL_BLOCK     (256)   /* 1ブロックの行数 */
+#define SPILL_MAPS      (4)     /* 同時にmmapしておくブロックの数 */
+#define SPILL_LINES     (8)     /* getSpilledLineが返すLineの数 */
+#define HEADER_SIZE     (SPILL_BLOCK * sizeof(uint32_t))
+
+/* 1行分のレコード (この後にstr, attr, fg, bgがlen + 1個ずつ続く) */
+typedef struct Record {
+	uint32_t len;
+	uint64_t ver;
+	Color fill;
+	int wrap;
+} Record;
+
+typedef struct Block {
+	off_t off;      /* ファイル内の位置 */
+	size_t size;    /* 大きさ */
+} Block;
+
+struct Spill {
+	int fd;                 /* 一時ファイルのFD */
+	off_t filesize;         /* ファイルの大きさ */
+	Block *blocks;          /* 書き出したブロックの位置 */
+	int blocks_len;         /* 書き出したブロックの数 */
+	char *buf;              /* 書き込み中のブロック */
+	size_t buflen, bufsize; /* 書き込み中のブロックの長さと確保した大きさ */
+	int lines;              /* 書き込み中のブロックの行数 */
+	struct Map {
+		int block;      /* ブロック番号 (-1は空き) */
+		char *addr;     /* mmapしたアドレス */
+		char *head;     /* ブロックの先頭 */
+		size_t len;     /* mmapした長さ */
+	} maps[SPILL_MAPS];
+	int nextmap;            /* 次に使うmaps */
+	Line out[SPILL_LINES];  /* 返すLine */
+	int nextout;            /* 次に使うout */
+};
+
+static bool flushBlock(Spill *);
+static char *mapBlock(Spill *, int);
+
+Spill *
+openSpill(void)
+{
+	const char *dir = getenv("TMPDIR");
+	char path[256];
+	Spill *spill;
+	int fd, i;
+
+	/* 一時ファイルを作ってすぐに消す */
+	snprintf(path, sizeof(path), "%s/chitan-XXXXXX", dir ? dir : "/tmp");
+	if ((fd = mkstemp(path)) < 0)
+		return NULL;
+	unlink(path);
+
+	spill = xmalloc(sizeof(Spill));
+	*spill = (Spill){ .fd = fd };
+	for (i = 0; i < SPILL_MAPS; i++)
+		spill->maps[i].block = -1;
+
+	spill->bufsize = HEADER_SIZE * 64;
+	spill->buf = xmalloc(spill->bufsize);
+	spill->buflen = HEADER_SIZE;
+
+	return spill;
+}
+
+void
+closeSpill(Spill *spill)
+{
+	int i;
+
+	if (spill == NULL)
+		return;
+
+	for (i = 0; i < SPILL_MAPS; i++)
+		if (0 <= spill->maps[i].block)
+			munmap(spill->maps[i].addr, spill->maps[i].len);
+	close(spill->fd);
+	free(spill->blocks);
+	free(spill->buf);
+	free(spill);
+}
+
+/* 書き出しに失敗したらfalseを返す */
+bool
+spillLine(Spill *spill, const Line *line)
+{
+	const size_t len = u32slen(line->str) + 1;
+	const size_t size = sizeof(Record) + len * 4 * sizeof(uint32_t);
+	Record *rec;
+	char *p;
+
+	/* 書き込み中のブロックを伸ばす */
+	while (spill->bufsize < spill->buflen + size) {
+		spill->bufsize *= 2;
+		spill->buf = xrealloc(spill->buf, spill->bufsize);
+	}
+
+	/* ヘッダに位置を書いてからレコードを追記 */
+	((uint32_t *)spill->buf)[spill->lines++] = spill->buflen;
+	p = spill->buf + spill->buflen;
+	rec = (Record *)p;
+	*rec = (Record){ .len = len - 1, .ver = line->ver, .fill = line->fill,
+		.wrap = line->wrap };
+	p += sizeof(Record);
+	memcpy(p, line->str,  len * sizeof(char32_t)); p += len * sizeof(char32_t);
+	memcpy(p, line->attr, len * sizeof(int));      p += len * sizeof(int);
+	memcpy(p, line->fg,   len * sizeof(Color));    p += len * sizeof(Color);
+	memcpy(p, line->bg,   len * sizeof(Color));    p += len * sizeof(Color);
+	spill->buflen = p - spill->buf;
+
+	/* ブロックが埋まったら書き出す */
+	if (spill->lines == SPILL_BLOCK)
+		return flushBlock(spill);
+
+	return true;
+}
+
+bool
+flushBlock(Spill *spill)
+{
+	const char *p = spill->buf;
+	size_t rest = spill->buflen;
+	ssize_t n;
+	Block block = { spill->filesize, spill->buflen };
+
+	for (; 0 < rest; p += n, rest -= n)
+		if ((n = write(spill->fd, p, rest)) < 0)
+			return false;
+
+	PUSH_BACK(spill->blocks, spill->blocks_len, block);
+	spill->filesize += block.size;
+	spill->buflen = HEADER_SIZE;
+	spill->lines = 0;
+
+	return true;
+}
+
+char *
+mapBlock(Spill *spill, int num)
+{
+	const long pagesize = sysconf(_SC_PAGESIZE);
+	struct Map *map;
+	off_t head;
+	int i;
+
+	/* 既にmmapしてあればそれを使う */
+	for (i = 0; i < SPILL_MAPS; i++)
+		if (spill->maps[i].block == num)
+			return spill->maps[i].head;
+
+	/* 古いものから順に使い回す */
+	map = &spill->maps[spill->nextmap];
+	spill->nextmap = (spill->nextmap + 1) % SPILL_MAPS;
+	if (0 <= map->block)
+		munmap(map->addr, map->len);
+
+	/* オフセットはページ境界に揃える必要がある */
+	head = spill->blocks[num].off & ~(off_t)(pagesize - 1);
+	map->len = spill->blocks[num].size + (spill->blocks[num].off - head);
+	map->addr = mmap(NULL, map->len, PROT_READ, MAP_SHARED, spill->fd, head);
+	if (map->addr == MAP_FAILED) {
+		map->block = -1;
+		return NULL;
+	}
+	map->block = num;
+	map->head = map->addr + (spill->blocks[num].off - head);
+
+	return map->head;
+}
+
+/*
+ * index行目のLineを返す
+ *
+ * Lineは書き込み中のブロックかmmapした領域を直接指していて、どちらも
+ * 次のspillLineやgetSpilledLineで動いたり解放されたりしうる。
+ * 使えるのは次にどちらかを呼ぶまでなので、残しておくならコピーすること。
+ */
+Line *
+getSpilledLine(Spill *spill, int64_t index)
+{
+	const int num = index / SPILL_BLOCK;
+	const char *head;
+	Record *rec;
+	Line *line;
+	char *p;
+
+	if (index < 0 || (int64_t)spill->blocks_len * SPILL_BLOCK + spill->lines <= index)
+		return NULL;
+
+	/* 書き込み中のブロックかファイル上のブロックか */
+	head = num < spill->blocks_len ? mapBlock(spill, num) : spill->buf;
+	if (head == NULL)
+		return NULL;
+
+	/* レコードを指すLineを作る */
+	p = (char *)head + ((uint32_t *)head)[index % SPILL_BLOCK];
+	rec = (Record *)p;
+	line = &spill->out[spill->nextout];
+	spill->nextout = (spill->nextout + 1) % SPILL_LINES;
+
+	*line = (Line){ .len = rec->len + 1, .ver = rec->ver, .fill = rec->fill,
+		.wrap = rec->wrap };
+	p += sizeof(Record);
+	line->str  = (char32_t *)p; p += line->len * sizeof(char32_t);
+	line->attr = (int *)p;      p += line->len * sizeof(int);
+	line->fg   = (Color *)p;    p += line->len * sizeof(Color);
+	line->bg   = (Color *)p;
+
+	return line;
+}
@@ -0,0 +1,8 @@
+#include <stdbool.h>
+
+typedef struct Spill Spill;
+
+Spill *openSpill(void);
+void closeSpill(Spill *);
+bool spillLine(Spill *, const Line *);
+Line *getSpilledLine(Spill *, int64_t);        /* 次にspillLineかgetSpilledLineを呼ぶまで有効 */
@@ -1,6 +1,7 @@
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +9,7 @@
 #include <wchar.h>
 
 #include "term.h"
+#include "spill.h"
 #include "util.h"
 #include "colors.h"
 
@@ -18,7 +20,7 @@
  */
 
 #define READ_SIZE       (1 << 14)
-#define LINE(a, b)      ((a)->lines[(b) % (a)->maxlines])
+#define LINE(a, b)      ((a)->lines[(b) & (a)->mask])
 #define IS_GC(c)        (BETWEEN((c), 0x20, 0x7f) || (c) & 0x80)
 
 enum cseq_type { CS_DCS, CS_SOS, CS_OSC, CS_PM, CS_APC, CS_k };
@@ -36,20 +38,29 @@ static void linefeed(Term *);
 static void setCursorPos(Term *, int, int);
 static void moveCursorPos(Term *, int, int, int);
 static void areaScroll(Term *, int, int, int);
+static void growBuffer(ScrBuf *, int64_t);
+static void rotateRows(ScrBuf *, int, int, int);
+static void normalizeRegion(ScrBuf *);
+static void addDamage(ScrBuf *, Damage);
+static int64_t rowIndex(const ScrBuf *, int64_t);
+static Line *editLine(ScrBuf *, int64_t);
+static void touchRows(ScrBuf *, int, int);
 static void optset(Term *, unsigned int, int);
 static void decset(Term *, unsigned int, int);
 static void setScrBufSize(Term *term, int, int);
+static void reflowScreen(Term *, int);
+static int fitChars(const char32_t *, int);
 static void setSGR(Term *, char *, size_t);
 static void setSGRColor(Color *, char **, const char *);
 static const char *designateCharSet(Term *, const char *, const char *);
 
 Term *
-openTerm(int row, int col, int bufsize, const char *program, char *const cmd[])
+openTerm(int row, int col, int bufsize, bool spill, const char *program, char *const cmd[])
 {
 	Term *term;
 	char *sname;
-	int slave;
-	int i;
+	int slave, size;
+	int64_t i;
 
 	/* 構造体の初期化 */
 	term = xmalloc(sizeof(Term));
@@ -58,21 +69,31 @@ openTerm(int row, int col, int bufsize, const char *program, char *const cmd[])
 	term->gl = &term->g[0];
 
 	/* スクリーンバッファの初期化 */
+	/* 添字をマスクで求められるよう、リングの大きさは2の冪に切り上げる。
+	 * 行を確保するのはbufsize行だけで、残りの場所は空けておく */
 	row = row < bufsize ? row : bufsize;
+	for (size = 1; size < bufsize; size <<= 1);
 	term->ori = term->alt = (struct ScrBuf){
 		.firstline = 0,
 		.totallines = row,
 		.maxlines = bufsize,
+		.mask = size - 1,
 		.rows = row, .cols = col,
 		.scrs = 0, .scre = row - 1,
+		.dirty_head = INT64_MAX, .dirty_tail = 0,
 	};
-	term->ori.lines = xmalloc(term->ori.maxlines * sizeof(Line *));
-	term->alt.lines = xmalloc(term->alt.maxlines * sizeof(Line *));
+	term->ori.lines = xmalloc(size * sizeof(Line *));
+	term->alt.lines = xmalloc(size * sizeof(Line *));
 	term->sb = &term->ori;
-	for (i = 0; i < term->ori.maxlines; i++)
-		term->ori.lines[i] = allocLine();
-	for (i = 0; i < term->alt.maxlines; i++)
-		term->alt.lines[i] = allocLine();
+	term->pool = createLinePool();
+	for (i = 0; i < size; i++)
+		term->ori.lines[i] = term->alt.lines[i] = NULL;
+	for (i = row - bufsize; i < row; i++) {
+		LINE(&term->ori, i) = allocLine(term->pool);
+		LINE(&term->alt, i) = allocLine(term->pool);
+	}
+	if (spill && !(term->ori.spill = openSpill()))
+		fprintf(stderr, "Could not open spill file.\n");
 
 	/* リードバッファの初期化 */
 	term->readbuf = xmalloc(READ_SIZE + 1);
@@ -174,13 +195,15 @@ closeTerm(Term *term)
 	if (0 <= term->master)
 		close(term->master);
 
-	for (i = 0; i < term->ori.maxlines; i++)
+	for (i = 0; i <= term->ori.mask; i++)
 		freeLine(term->ori.lines[i]);
-	for (i = 0; i < term->alt.maxlines; i++)
+	for (i = 0; i <= term->alt.mask; i++)
 		freeLine(term->alt.lines[i]);
 
 	free(term->ori.lines);
 	free(term->alt.lines);
+	closeSpill(term->ori.spill);
+	destroyLinePool(term->pool);
 	free(term->readbuf);
 	free(term->palette);
 	free(term->def_palette);
@@ -249,6 +272,10 @@ GCs(Term *term, const char *head)
 		/* 自動改行 */
 		if (term->sb->am) {
 			max = term->sb->cols;
+			if ((line = editLine(term->sb, term->cy))) {
+				line->wrap = 1;
+				touchLine(line, 0, 0);
+			}
 			setCursorPos(term, 0, term->cy);
 			linefeed(term);
 		}
@@ -259,12 +286,14 @@ GCs(Term *term, const char *head)
 		wlen = MAX(wlen, 1);
 
 		/* 書き込む */
-		if ((line = getLine(term->sb, term->cy))) {
+		if ((line = editLine(term->sb, term->cy))) {
 			term->cx += putU32s(line, term->cx, dp, term->attr,
 					term->fg, term->bg, wlen);
 			index = getIndex(line->str, term->sb->cols);
-			if (index < u32slen(line->str))
+			if (index < u32slen(line->str)) {
 				line->str[index] = L'\0';
+				touchLine(line, index, INT_MAX);
+			}
 		}
 	}
 
@@ -422,13 +451,14 @@ CSI(Term *term, const char *head, const char *tail)
 
 	/* 中間バイトがないもの */
 	switch (final) {
-	case 0x40: /* ICH 文字挿入 */
-		if ((line = getLine(sb, term->cy))) {
+	case 0x40: /* ICH 文字挿入 (行末より後ろでは何も起きない) */
+		if ((line = editLine(term->sb, term->cy)) && term->cx <= u32swidth(line->str)) {
 			len = MAX(atoi(param), 1);
 			char32_t str[len];
 			INIT(str, L' ');
 			insertU32s(line, getIndex(line->str, term->cx),
 					str, NONE, deffg, defbg, len);
+			addDamage(term->sb, (Damage){ DAMAGE_INSERT, term->cy, term->cy, term->cx, len });
 		}
 		break;
 
@@ -464,16 +494,17 @@ CSI(Term *term, const char *head, const char *tail)
 		switch (*param) {
 		default:
 		case '0':
-			line = getLine(sb, term->cy);
-			if (line && 0 < (len = sb->cols - term->cx))
-				putSPCs(line, term->cx, term->bg, len);
+			if ((line = editLine(term->sb, term->cy)))
+				clearToEnd(line, term->cx, term->bg);
+			addDamage(term->sb, (Damage){ DAMAGE_CLEAR,
+					term->cy, term->cy, term->cx, 0, term->bg });
 			a = term->cy + 1;
 			b = sb->rows;
 			break;
 		case '1':
 			a = 0;
 			b = term->cy;
-			if ((line = getLine(sb, term->cy)))
+			if ((line = editLine(term->sb, term->cy)))
 				putSPCs(line, 0, term->bg, term->cx + 1);
 			break;
 		case '2':
@@ -482,24 +513,29 @@ CSI(Term *term, const char *head, const char *tail)
 			break;
 		}
 		for (i = a; i < b; i++)
-			if ((line = getLine(sb, i)))
-				PUT_NUL(line, 0);
+			if ((line = editLine(term->sb, i)))
+				clearToEnd(line, 0, term->bg);
+		if (a < b)
+			addDamage(term->sb, (Damage){ DAMAGE_CLEAR, a, b - 1, 0, 0, term->bg });
 		break;
 
 	case 0x4b: /* EL 行内消去 */
-		if (!(line = getLine(sb, term->cy)))
+		if (!(line = editLine(term->sb, term->cy)))
 			break;
 		switch (*param) {
 		default:
 		case '0':
-			if (0 < (len = sb->cols - term->cx))
-				putSPCs(line, term->cx, term->bg, len);
+			clearToEnd(line, term->cx, term->bg);
+			addDamage(term->sb, (Damage){ DAMAGE_CLEAR,
+					term->cy, term->cy, term->cx, 0, term->bg });
 			break;
 		case '1':
 			putSPCs(line, 0, term->bg, term->cx + 1);
 			break;
 		case '2':
-			putSPCs(line, 0, term->bg, sb->cols);
+			clearToEnd(line, 0, term->bg);
+			addDamage(term->sb, (Damage){ DAMAGE_CLEAR,
+					term->cy, term->cy, 0, 0, term->bg });
 			break;
 		}
 		break;
@@ -515,8 +551,11 @@ CSI(Term *term, const char *head, const char *tail)
 		break;
 
 	case 0x50: /* DCH 文字削除 */
-		if ((line = getLine(sb, term->cy)))
-			eraseInLine(line, term->cx, MAX(atoi(param), 1));
+		if ((line = editLine(term->sb, term->cy))) {
+			len = MAX(atoi(param), 1);
+			eraseInLine(line, term->cx, len);
+			addDamage(term->sb, (Damage){ DAMAGE_DELETE, term->cy, term->cy, term->cx, len });
+		}
 		break;
 
 	case 0x53: /* SU スクロール上 */
@@ -532,8 +571,15 @@ CSI(Term *term, const char *head, const char *tail)
 		break;
 
 	case 0x58: /* ECH 文字消去 */
-		if ((line = getLine(sb, term->cy)))
-			putSPCs(line, term->cx, term->bg, atoi(param));
+		if (!(line = editLine(term->sb, term->cy)))
+			break;
+		len = MAX(atoi(param), 1);
+		if (sb->cols <= term->cx + len) {
+			clearToEnd(line, term->cx, term->bg);
+			addDamage(term->sb, (Damage){ DAMAGE_CLEAR,
+					term->cy, term->cy, term->cx, 0, term->bg });
+		} else
+			putSPCs(line, term->cx, term->bg, len);
 		break;
 
 	case 0x63: /* DA 装置識別 */
@@ -578,6 +624,7 @@ CSI(Term *term, const char *head, const char *tail)
 		b = p && (p < param + p_len) ? atoi(p + 1) : sb->rows;
 		if (b <= a)
 			break;
+		normalizeRegion(term->sb);
 		term->sb->scrs = CLIP(a, 1, sb->rows) - 1;
 		term->sb->scre = CLIP(b, 1, sb->rows) - 1;
 		setCursorPos(term, 0, term->dec[6] < 2 ? 0 : term->sb->scrs);
@@ -807,22 +854,82 @@ areaScroll(Term *term, int first, int last, int num)
 {
 	struct ScrBuf *sb = term->sb;
 	const int area = last - first + 1;
-	Line *tmp[area];
-	int index, index2;
-	int i;
+	int64_t index;
+	int64_t i;
 
 	if (first < 0 || last < first || sb->rows < last)
 		return;
 
-	num = CLIP(num, -sb->rows, sb->rows);
+	num = CLIP(num, -area, area);
+	addDamage(sb, (Damage){ DAMAGE_SCROLL, first, last, 0, num });
+
+	/* スクロール範囲全体の場合は回転量を変えるだけ */
+	if (first == sb->scrs && last == sb->scre && !(0 < num && first == 0)) {
+		touchRows(sb, first, last);
+		sb->rofs = ((sb->rofs + num) % area + area) % area;
+		for (i = 0 < num ? area - num : 0; i < (0 < num ? area : -num); i++) {
+			index = rowIndex(sb, first + i);
+			LINE(sb, index) = unshareLine(LINE(sb, index));
+			PUT_NUL(LINE(sb, index), 0);
+		}
+		return;
+	}
+
+	/* それ以外は回転を解消してから行を入れ替える */
+	normalizeRegion(sb);
 
 	/* 画面上端から行が押し出される場合 */
 	if (0 < num && first == 0) {
+		/* 画面外に出る行は共有する */
+		for (i = 0; i < num; i++)
+			LINE(sb, sb->firstline + i) = shareLine(LINE(sb, sb->firstline + i));
 		sb->firstline += num;
-		sb->totallines = MAX(sb->totallines, sb->firstline + sb->rows);
-		return areaScroll(term, last + 1 - num, sb->rows - 1, -num);
+		growBuffer(sb, sb->firstline + sb->rows);
+		/* スクロール範囲より下の行は元の位置に戻す */
+		rotateRows(sb, last + 1 - num, sb->rows - 1, -num);
+		return;
 	}
 
+	rotateRows(sb, first, last, num);
+}
+
+/*
+ * バッファの総行数をtotalまで増やす
+ * 溢れる行は退避してから、入ってくる行の場所に移して使い回す
+ */
+void
+growBuffer(ScrBuf *sb, int64_t total)
+{
+	int64_t i;
+
+	for (i = sb->totallines; i < total; i++) {
+		/* 書き出せなかったら退避をやめてリングバッファだけで続ける */
+		if (sb->spill && 0 <= i - sb->maxlines &&
+		    !spillLine(sb->spill, LINE(sb, i - sb->maxlines))) {
+			fprintf(stderr, "Could not write spill file. Spilled lines are discarded.\n");
+			closeSpill(sb->spill);
+			sb->spill = NULL;
+		}
+		if (&LINE(sb, i) != &LINE(sb, i - sb->maxlines)) {
+			LINE(sb, i) = LINE(sb, i - sb->maxlines);
+			LINE(sb, i - sb->maxlines) = NULL;
+		}
+	}
+	sb->totallines = MAX(sb->totallines, total);
+}
+
+/* first行目からlast行目までをnum行回転させ、入ってきた行を空にする */
+void
+rotateRows(ScrBuf *sb, int first, int last, int num)
+{
+	const int area = last - first + 1;
+	Line *tmp[area];
+	int64_t index;
+	int index2;
+	int i;
+
+	touchRows(sb, first, last);
+
 	/* スクロール範囲にある行を取得 */
 	for (i = 0; i < area; i++) {
 		index = sb->firstline + first + i;
@@ -834,11 +941,91 @@ areaScroll(Term *term, int first, int last, int num)
 		index = sb->firstline + first + i;
 		index2 = (i + num) % area;
 		LINE(sb, index) = tmp[index2 < 0 ? index2 + area : index2];
-		if (i + num < 0 || area <= i + num)
+		if (i + num < 0 || area <= i + num) {
+			LINE(sb, index) = unshareLine(LINE(sb, index));
 			PUT_NUL(LINE(sb, index), 0);
+		}
 	}
 }
 
+void
+normalizeRegion(ScrBuf *sb)
+{
+	const int area = sb->scre - sb->scrs + 1;
+	Line *tmp[area];
+	int i;
+
+	if (sb->rofs == 0)
+		return;
+
+	/* 回転している行を本来の位置に並べ直す */
+	for (i = 0; i < area; i++)
+		tmp[i] = LINE(sb, sb->firstline + sb->scrs + (i + sb->rofs) % area);
+	for (i = 0; i < area; i++)
+		LINE(sb, sb->firstline + sb->scrs + i) = tmp[i];
+	sb->rofs = 0;
+}
+
+/*
+ * 前回の描画以降の画面の変化を記録する
+ *
+ * 同じ範囲を同じ向きに続けてスクロールした場合はまとめる。
+ * 記録しきれなくなったらdamage_lenをDAMAGE_MAXより大きくして、
+ * 描画側には使えないことを知らせる。
+ */
+void
+addDamage(ScrBuf *sb, Damage dmg)
+{
+	Damage *prev = sb->damage_len ? &sb->damage[sb->damage_len - 1] : NULL;
+
+	if (DAMAGE_MAX < sb->damage_len)
+		return;
+
+	if (prev && dmg.type == DAMAGE_SCROLL && prev->type == DAMAGE_SCROLL &&
+	    prev->first == dmg.first && prev->last == dmg.last &&
+	    (0 < prev->num) == (0 < dmg.num)) {
+		prev->num = CLIP(prev->num + dmg.num,
+				dmg.first - dmg.last - 1, dmg.last - dmg.first + 1);
+		return;
+	}
+
+	if (sb->damage_len < DAMAGE_MAX)
+		sb->damage[sb->damage_len++] = dmg;
+	else
+		sb->damage_len = DAMAGE_MAX + 1;
+}
+
+int64_t
+rowIndex(const ScrBuf *sb, int64_t row)
+{
+	/* スクロール範囲内の行は回転量だけずらす */
+	if (sb->rofs && sb->scrs <= row && row <= sb->scre)
+		row = sb->scrs + (row - sb->scrs + sb->rofs) % (sb->scre - sb->scrs + 1);
+
+	return sb->firstline + row;
+}
+
+/* 書き換える画面内の行を取得する */
+Line *
+editLine(ScrBuf *sb, int64_t row)
+{
+	touchRows(sb, row, row);
+	return getLine(sb, row);
+}
+
+/*
+ * 画面のfirst行目からlast行目までを書き換えたことを記録する
+ *
+ * 選択範囲はバッファ上の位置で持つので、範囲も絶対位置で記録し、
+ * 選択範囲の行を1行ずつ調べなくても書き換えられたか分かるようにする。
+ */
+void
+touchRows(ScrBuf *sb, int first, int last)
+{
+	sb->dirty_head = MIN(sb->dirty_head, sb->firstline + first);
+	sb->dirty_tail = MAX(sb->dirty_tail, sb->firstline + last + 1);
+}
+
 void
 optset(Term *term, unsigned int num, int flag)
 {
@@ -895,7 +1082,7 @@ decset(Term *term, unsigned int num, int flag)
 			term->svy = term->cy;
 			if (num == 1049)
 				for (i = 0; i < term->sb->rows; i++)
-					if ((line = getLine(term->sb, i)))
+					if ((line = editLine(term->sb, i)))
 						PUT_NUL(line, 0);
 		} else {
 			setCursorPos(term, term->svx, term->svy);
@@ -938,16 +1125,27 @@ void
 setScrBufSize(Term *term, int row, int col)
 {
 	struct ScrBuf *sb = term->sb;
-	int newfst = sb->firstline;
+	int64_t newfst;
+	int64_t i;
+
+	normalizeRegion(sb);
+
+	/* 列数が変わったら画面内の行を折り返し直す */
+	if (col != sb->cols && sb == &term->ori)
+		reflowScreen(term, col);
+	newfst = sb->firstline;
 
 	/* 行数が減ってカーソルが画面外に出たとき */
-	if (row < sb->rows && row - 1 < term->cy)
+	if (row < sb->rows && row - 1 < term->cy) {
 		newfst = sb->firstline + (term->cy - row) + 1;
+		for (i = sb->firstline; i < newfst; i++)
+			LINE(sb, i) = shareLine(LINE(sb, i));
+	}
 	/* 行数が増えたとき */
 	if (sb->rows < row) {
 		newfst = MAX(sb->firstline - (row - sb->rows), 0);
 		newfst = MAX(sb->totallines - sb->maxlines, newfst);
-		sb->totallines = MAX(newfst + row, sb->totallines);
+		growBuffer(sb, newfst + row);
 	}
 
 	/* 画面サイズ変更 */
@@ -963,6 +1161,115 @@ setScrBufSize(Term *term, int row, int col)
 	}
 }
 
+/*
+ * 画面内の行を列数colで折り返し直す
+ *
+ * 折り返しで繋がっている行を1つにまとめてから切り直す。
+ * 画面に収まらない行はスクロールバックに送り、カーソルは同じ文字の上に置く。
+ * スクロールバックの行は元の折り返しのまま残すので、
+ * 手間はスクロールバックの行数によらない。
+ */
+void
+reflowScreen(Term *term, int col)
+{
+	struct ScrBuf *sb = term->sb;
+	const int rows = sb->rows;
+	Line *logs[rows], *line;
+	int counts[rows];
+	int n = 0, total = 0, scrolled = 0;
+	int cl = 0, co = 0, cy = 0, cx = 0;
+	int i, j, head, start, cnt, w;
+	bool found = false;
+
+	/* 折り返しで繋がっている行をまとめる */
+	for (i = 0; i < rows; i++) {
+		if (!(line = getLine(sb, i)))
+			continue;
+		if (n == 0 || !logs[n - 1]->wrap) {
+			logs[n++] = allocLine(term->pool);
+		}
+		if (i == term->cy) {
+			cl = n - 1;
+			co = u32swidth(logs[n - 1]->str) + term->cx;
+		}
+		appendLine(logs[n - 1], line);
+	}
+	if (n == 0)
+		return;
+	logs[n - 1]->wrap = 0;
+
+	/* 新しい列数での行数を数える */
+	for (i = 0; i < n; i++) {
+		counts[i] = 0;
+		head = 0;
+		do {
+			head += fitChars(logs[i]->str + head, col);
+			counts[i]++;
+		} while (logs[i]->str[head] != L'\0');
+		total += counts[i];
+	}
+
+	/* 収まらなければカーソルより下の行から捨てる */
+	while (rows < total && cl < n - 1) {
+		total -= counts[--n];
+		freeLine(logs[n]);
+	}
+
+	/* 切り直して画面に書き戻す */
+	sb->scrs = 0;
+	sb->scre = rows - 1;
+	for (i = 0, j = 0; i < n; i++) {
+		head = start = 0;
+		do {
+			cnt = fitChars(logs[i]->str + head, col);
+			w = u32snwidth(logs[i]->str + head, cnt);
+
+			/* 画面の下に達したらスクロールさせる */
+			if (rows <= j) {
+				areaScroll(term, 0, rows - 1, 1);
+				scrolled++;
+			}
+			line = editLine(sb, MIN(j, rows - 1));
+			linecpy(line, logs[i]);
+			line->str[head + cnt] = L'\0';
+			deleteChars(line, 0, head);
+			line->wrap = logs[i]->str[head + cnt] != L'\0';
+			touchLine(line, 0, INT_MAX);
+
+			/* カーソルのある文字を含む行を探す */
+			if (i == cl && !found && (co < start + w || !line->wrap)) {
+				found = true;
+				cy = j;
+				cx = co - start;
+			}
+
+			head += cnt;
+			start += w;
+			j++;
+		} while (logs[i]->str[head] != L'\0');
+		freeLine(logs[i]);
+	}
+
+	/* 余った行を消す */
+	for (; j < rows; j++)
+		if ((line = editLine(sb, j)))
+			PUT_NUL(line, 0);
+
+	term->cx = CLIP(cx, 0, col - 1);
+	term->cy = CLIP(cy - scrolled, 0, rows - 1);
+	sb->am = 0;
+}
+
+/* 幅colに収まる文字数 (1文字も収まらなくても1文字は入れる) */
+int
+fitChars(const char32_t *str, int col)
+{
+	const int len = u32slen(str);
+	const int cnt = MIN(getIndex(str, col), len);
+
+	return (cnt == 0 && 0 < len) ? 1 : cnt;
+}
+
 void
 reportMouse(Term *term, int btn, int release, int mx, int my)
 {
@@ -1155,30 +1462,59 @@ designateCharSet(Term *term, const char *head, const char *tail)
 	return head + 1;
 }
 
+int64_t
+getOldestLine(const ScrBuf *sb)
+{
+	/* 退避している場合は最初の行から残っている */
+	return sb->spill ? 0 : MAX(sb->totallines - sb->maxlines, 0);
+}
+
+/*
+ * 画面上row行目の行を取得する
+ * 共有している行が画面内に戻ってきていたら複製してバッファの行を差し替える
+ */
 Line *
-getLine(const ScrBuf *sb, int row)
+getLine(ScrBuf *sb, int64_t row)
 {
-	const int index = sb->firstline + row;
-	const int oldest = MAX(sb->totallines - sb->maxlines, 0);
+	int64_t index = sb->firstline + row;
 
-	if (index < oldest || sb->totallines <= index || sb->rows <= row)
+	if (index < getOldestLine(sb) || sb->totallines <= index || sb->rows <= row)
 		return NULL;
+	index = rowIndex(sb, row);
+
+	/* リングバッファから溢れた行はファイルから読む */
+	if (index < sb->totallines - sb->maxlines)
+		return getSpilledLine(sb->spill, index);
+
+	/* 共有している行が画面内に戻ってきていたら書き換えられるようにする */
+	if (0 <= row && LINE(sb, index)->ref)
+		LINE(sb, index) = unshareLine(LINE(sb, index));
 
 	return LINE(sb, index);
 }
 
+/*
+ * 画面上-scr行目からlen行をlinesにコピーする
+ * getLineを使うので、画面内に戻ってきた共有している行はバッファ側で複製される
+ */
 void
-getLines(const ScrBuf *sb, Line **lines, int len, int scr, const Selection *sel)
+getLines(ScrBuf *sb, Line **lines, int len, int scr, const Selection *sel,
+		const uint64_t *vers)
 {
 	Line *line;
-	int i, j, s, e, a, b, li, ri;
+	bool copied[len];
+	int64_t s, e;
+	int i, j, a, b, li, ri;
 
-	/* 指定された範囲をコピー */
+	/* 指定された範囲をコピー (versと同じバージョンの行は前回のまま) */
 	for (i = 0; i < len; i++) {
-		if ((line = getLine(sb, i - scr)))
-			linecpy(lines[i], line);
-		else
+		copied[i] = true;
+		if (!(line = getLine(sb, i - scr)))
 			PUT_NUL(lines[i], 0);
+		else if (vers && vers[i] == line->ver)
+			copied[i] = false;
+		else
+			linecpy(lines[i], line);
 	}
 
 	/* selectionの範囲を反転色にする */
@@ -1187,6 +1523,9 @@ getLines(const ScrBuf *sb, Line **lines, int len, int scr, const Selection *sel)
 	s = MIN(sel->aline, sel->bline) - sb->firstline + scr;
 	e = MAX(sel->aline, sel->bline) - sb->firstline + scr;
 	for (i = MAX(s, 0); i < MIN(e + 1, len); i++) {
+		if (!copied[i])
+			continue;
+
 		a = 0;
 		b = sb->cols + 2;
 
@@ -1209,9 +1548,6 @@ getLines(const ScrBuf *sb, Line **lines, int len, int scr, const Selection *sel)
 void
 setSelection(Selection *sel, ScrBuf *sb, int row, int col, bool start, bool rect)
 {
-	Line *line;
-	int s, e, i;
-
 	/* 範囲をセット */
 	if (start) {
 		sel->sb = sb;
@@ -1224,30 +1560,23 @@ setSelection(Selection *sel, ScrBuf *sb, int row, int col, bool start, bool rect
 	sel->bline = MAX(row + sb->firstline, 0);
 	sel->rect = rect;
 
-	/* 行のバージョンを記録 */
-	s = MIN(sel->aline, sel->bline);
-	e = MAX(sel->aline, sel->bline);
-	sel->vers = xrealloc(sel->vers, (e - s + 1) * sizeof(int));
-	for (i = 0; i <= e - s; i++)
-		if ((line = getLine(sb, s - sb->firstline + i)))
-			sel->vers[i] = line->ver;
+	/* これより前の書き換えは選択範囲に関係ない */
+	sb->dirty_head = INT64_MAX;
+	sb->dirty_tail = 0;
 }
 
+/* 前回調べてから選択範囲の行が書き換えられたか (バッファに記録した範囲と比べる) */
 bool
 checkSelection(Selection *sel)
 {
-	const int s = MIN(sel->aline, sel->bline);
-	const int e = MAX(sel->aline, sel->bline);
-	Line *line;
-	int i, first = sel->sb->firstline;
+	ScrBuf *sb = sel->sb;
+	const bool changed = sb->dirty_head <= MAX(sel->aline, sel->bline) &&
+		MIN(sel->aline, sel->bline) < sb->dirty_tail;
 
-	for (i = 0; i <= e - s; i++) {
-		line = getLine(sel->sb, s - first + i);
-		if (line != NULL && line->ver != sel->vers[i])
-			return true;
-	}
+	sb->dirty_head = INT64_MAX;
+	sb->dirty_tail = 0;
 
-	return false;
+	return changed;
 }
 
 void
@@ -1255,12 +1584,14 @@ copySelection(Selection *sel, char **dst, bool deltrail)
 {
 	int len = 256;
 	char32_t *cp, *copy = xmalloc(len * sizeof(copy[0]));
-	const int firstline = MIN(sel->aline, sel->bline);
-	const int lastline  = MAX(sel->aline, sel->bline);
+	const int64_t firstline = MIN(sel->aline, sel->bline);
+	const int64_t lastline  = MAX(sel->aline, sel->bline);
 	const int left      = MIN(sel->acol,  sel->bcol);
 	const int right     = MAX(sel->acol,  sel->bcol);
 	Line *line;
-	int i, j, l, r;
+	int64_t i;
+	int j, l, r;
+	bool wrap;
 
 	copy[0] = L'\0';
 
@@ -1284,14 +1615,17 @@ copySelection(Selection *sel, char **dst, bool deltrail)
 		wcsncpy((wchar_t *)cp, (wchar_t *)line->str + l, r - l);
 		cp[r - l] = L'\0';
 
-		if (deltrail) {
+		/* 折り返している行は改行も行末の空白の削除もせずに繋げる */
+		wrap = !sel->rect && line->wrap;
+
+		if (deltrail && !wrap) {
 			for (j = u32slen(cp); 0 < j; j--)
 				if (cp[j - 1] != L' ')
 					break;
 			cp[j] = L'\0';
 		}
 
-		if (i < lastline)
+		if (i < lastline && !wrap)
 			wcscat((wchar_t *)copy, L"\n");
 	}
 
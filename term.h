@@ -18,29 +18,54 @@ enum mouse_event_type {
 	OTHER   = 128
 };
 
+#define DAMAGE_MAX      (32)
+
+enum damage_type {
+	DAMAGE_SCROLL,  /* first行目からlast行目までをnum行スクロール */
+	DAMAGE_CLEAR,   /* first行目からlast行目までのcol列目以降をbgで消去 */
+	DAMAGE_INSERT,  /* first行目のcol列目にnum文字挿入 */
+	DAMAGE_DELETE   /* first行目のcol列目からnum列削除 */
+};
+
+/* 画面の変化 */
+typedef struct Damage {
+	enum damage_type type;
+	int first, last;
+	int col, num;
+	Color bg;
+} Damage;
+
 /* バッファ */
 typedef struct ScrBuf {
 	Line **lines;   /* バッファ */
-	int maxlines;   /* バッファの最大行数*/
-	int firstline;  /* 画面上1行目となる行 */
-	int totallines; /* バッファの総行数 */
+	int maxlines;   /* バッファの最大行数 */
+	int mask;       /* 行の位置を求めるマスク (リングの大きさ - 1) */
+	int64_t firstline;  /* 画面上1行目となる行 */
+	int64_t totallines; /* バッファの総行数 */
 	int rows, cols; /* 画面の行数と列数 */
 	int scrs, scre; /* スクロール範囲 */
+	int rofs;       /* スクロール範囲の回転量 */
 	int am;         /* 自動改行 */
+	struct Spill *spill; /* 溢れた行の退避先 */
+	Damage damage[DAMAGE_MAX]; /* 前回の描画以降の変化 */
+	int damage_len;
+	int64_t dirty_head;     /* 選択範囲を調べた後に書き換えた行の範囲 */
+	int64_t dirty_tail;
 } ScrBuf;
 
 /* 選択範囲 */
 typedef struct Selection {
 	struct ScrBuf *sb;
-	int aline, acol, bline, bcol;
+	int64_t aline, bline;
+	int acol, bcol;
 	int rect;
-	int *vers;
 } Selection;
 
 /* 端末 */
 typedef struct Term {
 	int master;             /* 疑似端末のFD */
 	ScrBuf ori, alt, *sb;   /* バッファ */
+	LinePool *pool;         /* 行の確保元 */
 	int cx, cy;             /* カーソル位置 */
 	int svx, svy;           /* 保存したカーソル位置 */
 	int ctype;              /* カーソル形状 */
@@ -61,15 +86,16 @@ typedef struct Term {
 	int palette_cnt;        /* パレットを変更した回数 */
 } Term;
 
-Term *openTerm(int, int, int, const char *, char *const []);
+Term *openTerm(int, int, int, bool, const char *, char *const []);
 void closeTerm(Term *);
 ssize_t readPty(Term *);
 ssize_t writePty(Term *, const char *, ssize_t);
 void setWinSize(Term *, int, int, int, int);
 void reportMouse(Term *, int, int, int, int);
 
-Line *getLine(const ScrBuf *, int);
-void getLines(const ScrBuf *, Line **, int, int, const Selection *);
+int64_t getOldestLine(const ScrBuf *);
+Line *getLine(ScrBuf *, int64_t);
+void getLines(ScrBuf *, Line **, int, int, const Selection *, const uint64_t *);
 
 void setSelection(Selection *, ScrBuf *sb, int, int, bool, bool);
 bool checkSelection(Selection *);